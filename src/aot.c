@@ -0,0 +1,21 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#include "aot.h"
+#include <stdio.h>
+
+#ifdef __GNUC__
+__attribute__((weak))
+#endif
+void chip8_exec_aot(struct chip8 *chip)
+{
+	fprintf(stderr, "No recompiled ROM linked in, interpreting\n");
+	chip8_interpret(chip);
+}
@@ -0,0 +1,22 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#ifndef AOT_H
+#define AOT_H
+
+#include "chip8.h"
+
+/*
+ * Entry point of a ROM recompiled to C by rec8. Linking the generated file
+ * into chip8 replaces the default, which just interprets.
+ */
+void chip8_exec_aot(struct chip8 *chip);
+
+#endif /* AOT_H */
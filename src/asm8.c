@@ -18,13 +18,13 @@
 #include "encode.h"
 #include "chip8.h"
 
-#define USAGE_FMT "Usage: %s [FILE_NAME]\n"
+#define USAGE_FMT "Usage: %s [-o OUT_FILE] [-m MAP_FILE] [FILE_NAME]\n"
 #define BUFSIZE LINE_SIZE
 #define DEFAULT_OUT_FILE_NAME "a.out"
 
 static int label_exists(struct assembler *assembler, const char *label);
 
-void assemble(FILE *in_fp, FILE *out_fp);
+void assemble(FILE *in_fp, FILE *out_fp, FILE *map_fp);
 void find_labels(FILE *in_fp, struct assembler *assembler);
 void parse_statement(char line[LINE_SIZE], struct statement *stmt);
 void fsm_tick(struct fsm *fsm, struct statement *stmt, char buf[BUFSIZE], size_t *buf_len);
@@ -32,6 +32,7 @@ unsigned short statement_length(struct statement *stmt);
 void print_statement(struct statement *stmt);
 void write_assembly(FILE *in_fp, FILE *out_fp, struct assembler *assembler);
 static void print_labels(struct label labels[MAX_LABELS], size_t num_labels);
+static void write_map(FILE *map_fp, struct assembler *assembler);
 
 int main(int argc, char *argv[])
 {
@@ -39,17 +40,24 @@ int main(int argc, char *argv[])
 	FILE *in_fp;
 	char *out_file_name;
 	FILE *out_fp;
+	char *map_file_name;
+	FILE *map_fp;
 	extern char *optarg;
 	extern int optind;
 	int opt;
 
 	out_file_name = NULL;
-	while ((opt = getopt(argc, argv, "o:")) > 0) {
+	map_file_name = NULL;
+	map_fp = NULL;
+	while ((opt = getopt(argc, argv, "o:m:")) > 0) {
 		switch (opt) {
 		case 'o':
 			out_file_name = malloc(strlen(optarg) + 1);
 			strcpy(out_file_name, optarg);
 			break;
+		case 'm':
+			map_file_name = optarg;
+			break;
 		default:
 			/* Do nothing */
 			break;
@@ -79,19 +87,35 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	assemble(in_fp, out_fp);
+	if (map_file_name) {
+		map_fp = fopen(map_file_name, "w");
+		if (!map_fp) {
+			perror(map_file_name);
+			fclose(in_fp);
+			fclose(out_fp);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	assemble(in_fp, out_fp, map_fp);
 	fclose(in_fp);
+	if (map_fp) {
+		fclose(map_fp);
+	}
 	free(out_file_name);
 
 	return 0;
 }
 
-void assemble(FILE *in_fp, FILE *out_fp)
+void assemble(FILE *in_fp, FILE *out_fp, FILE *map_fp)
 {
 	struct assembler assembler;
 	assembler.num_labels = 0;
 
 	find_labels(in_fp, &assembler);
+	if (map_fp) {
+		write_map(map_fp, &assembler);
+	}
 	/* print_labels(labels, num_labels); */ /* DEBUG */
 	rewind(in_fp);
 	write_assembly(in_fp, out_fp, &assembler);
@@ -298,3 +322,13 @@ static int label_exists(struct assembler *assembler, const char *label)
 	}
 	return 0;
 }
+
+/* One "ADDRESS LABEL" line per label, for chip8 -m to name addresses by */
+static void write_map(FILE *map_fp, struct assembler *assembler)
+{
+	size_t i;
+	for (i = 0; i < assembler->num_labels; i++) {
+		fprintf(map_fp, "0x%03X %s\n", assembler->labels[i].addr,
+			assembler->labels[i].text);
+	}
+}
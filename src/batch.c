@@ -0,0 +1,664 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+/*
+ * chip8-batch: run many ROM/input-script pairs headless, spread over all
+ * cores. Each job advances a chunk of frames at a time; idle workers steal
+ * jobs from the others' queues, so a few long-running ROMs do not leave
+ * cores idle while the rest of the batch is done.
+ *
+ * With -L, jobs that share a ROM run as the lanes of a lockstep engine
+ * instead, up to LANES of them per group; groups are then the unit of work.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "chip8.h"
+#include "input.h"
+#include "lockstep.h"
+
+#define USAGE_FMT "Usage: %s [-j THREADS] [-n FRAMES] [-k CHUNK] " \
+	"[-L LANES] [-o OUTPUT] JOB_LIST\n"
+#define LINE_BUFSIZE 1024
+#define DEFAULT_FRAMES 600
+#define DEFAULT_CHUNK 60
+/* Instructions per frame, the same as chip8 -H */
+#define BATCH_IPF 10
+
+enum job_status {
+	JOB_RUNNING,
+	JOB_DONE,
+	JOB_FAULT,
+	JOB_FAILED
+};
+
+struct job {
+	char *rom;
+	char *script;
+	uint32_t seed;
+	int has_seed;
+	struct chip8 *chip;
+	struct chip8_keyboard keyboard;
+	struct chip8_renderer renderer;
+	struct chip8_input input;
+	unsigned long frames;
+	unsigned long cycles;
+	uint64_t state_hash;
+	uint64_t frame_hash;
+	enum job_status status;
+};
+
+/* Jobs for the same ROM, run in lockstep */
+struct group {
+	struct job **jobs;
+	size_t count;
+	struct chip8_lockstep *ls;
+	struct chip8 *chip;
+	unsigned long frames;
+};
+
+/* Owner pushes and pops at the tail, thieves take from the head */
+struct deque {
+	pthread_mutex_t lock;
+	size_t *slots;
+	size_t capacity;
+	size_t head;
+	size_t tail;
+};
+
+struct batch {
+	struct job *jobs;
+	size_t njobs;
+	struct group *groups;
+	size_t ngroups;
+	size_t lanes;
+	struct deque *queues;
+	int nthreads;
+	unsigned long max_frames;
+	unsigned long chunk;
+	pthread_mutex_t lock;
+	size_t remaining;
+};
+
+struct worker {
+	struct batch *batch;
+	int id;
+};
+
+static void null_render(struct chip8 *chip)
+{
+	(void) chip;
+}
+
+static void null_check(struct chip8 *chip)
+{
+	(void) chip;
+}
+
+static void deque_push(struct deque *dq, size_t job)
+{
+	pthread_mutex_lock(&dq->lock);
+	dq->slots[dq->tail % dq->capacity] = job;
+	dq->tail++;
+	pthread_mutex_unlock(&dq->lock);
+}
+
+static int deque_pop(struct deque *dq, size_t *job)
+{
+	int found = 0;
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail > dq->head) {
+		dq->tail--;
+		*job = dq->slots[dq->tail % dq->capacity];
+		found = 1;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return found;
+}
+
+static int deque_steal(struct deque *dq, size_t *job)
+{
+	int found = 0;
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail > dq->head) {
+		*job = dq->slots[dq->head % dq->capacity];
+		dq->head++;
+		found = 1;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return found;
+}
+
+static uint64_t hash_display(uint64_t hash, const uint64_t *display)
+{
+	const byte *p = (const byte *) display;
+	size_t i;
+	for (i = 0; i < CHIP8_DISPLAYH * sizeof(*display); i++) {
+		hash ^= p[i];
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+static int job_start(struct job *job)
+{
+	job->chip = malloc(sizeof(*job->chip));
+	if (job->chip == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	chip8_input_init(&job->input);
+	chip8_input_keyboard(&job->input, &job->keyboard);
+	job->renderer.data = NULL;
+	job->renderer.render_display = null_render;
+	chip8_init(job->chip, &job->keyboard, &job->renderer, null_check);
+	/* Frame boundaries must fall where the input log expects them */
+	job->chip->fusion_enabled = 0;
+	if (job->script && chip8_input_load(&job->input, job->script) < 0) {
+		return -1;
+	}
+	if (job->input.has_seed && !job->has_seed) {
+		job->seed = job->input.seed;
+	}
+	chip8_seed(job->chip, job->seed);
+	if (chip8_load(job->chip, job->rom) < 0) {
+		return -1;
+	}
+	job->chip->pc = CHIP8_PROGSTART;
+	job->frame_hash = 0xCBF29CE484222325ULL;
+	return 0;
+}
+
+/* A job that stopped on a fault finishes as JOB_FAULT, not JOB_DONE */
+static void job_finish(struct job *job, enum job_status status)
+{
+	if (status == JOB_DONE && job->chip != NULL
+		&& job->chip->fault != CHIP8_FAULT_NONE) {
+		status = JOB_FAULT;
+	}
+	job->status = status;
+	if (job->chip != NULL) {
+		job->cycles = job->chip->cycles;
+		job->state_hash = chip8_hash(job->chip);
+		free(job->chip);
+		job->chip = NULL;
+	}
+	chip8_input_free(&job->input);
+}
+
+/* Run one frame; returns 0 while the ROM is still going */
+static int run_frame(struct job *job)
+{
+	struct chip8 *chip = job->chip;
+	unsigned long end = (job->frames + 1) * BATCH_IPF;
+
+	chip8_input_frame(&job->input, job->frames);
+	chip->idle_until = end;
+	while (chip->cycles < end) {
+		if (chip->is_halted || chip->pc + 2 >= CHIP8_RAMBYTES) {
+			return 1;
+		}
+		if (chip8_exec_instruction(chip) < 0) {
+			return 1;
+		}
+	}
+	chip8_tick(chip, 1);
+	job->frames++;
+	job->frame_hash = hash_display(job->frame_hash, chip->display);
+	return 0;
+}
+
+/* Advance a job by one chunk of frames; returns 1 once it is finished */
+static int run_chunk(struct batch *batch, struct job *job)
+{
+	unsigned long i;
+
+	if (job->chip == NULL && job_start(job) < 0) {
+		job_finish(job, JOB_FAILED);
+		return 1;
+	}
+	for (i = 0; i < batch->chunk; i++) {
+		if (job->frames >= batch->max_frames || run_frame(job)) {
+			job_finish(job, JOB_DONE);
+			return 1;
+		}
+	}
+	if (job->frames >= batch->max_frames) {
+		job_finish(job, JOB_DONE);
+		return 1;
+	}
+	return 0;
+}
+
+static byte group_waitkey(struct chip8_lockstep *ls, size_t lane)
+{
+	struct group *group = ls->data;
+	struct chip8_input *input = &group->jobs[lane]->input;
+	byte key = chip8_input_waitkey(input);
+	ls->keys[lane] = input->keys;
+	return key;
+}
+
+static void group_end(struct group *group)
+{
+	chip8_lockstep_free(group->ls);
+	group->ls = NULL;
+	free(group->chip);
+	group->chip = NULL;
+}
+
+/* Load every job into its lane; a job that fails to load is skipped */
+static int group_start(struct group *group)
+{
+	struct job *job;
+	size_t lane;
+
+	group->ls = chip8_lockstep_new(group->count);
+	group->chip = malloc(sizeof(*group->chip));
+	if (group->ls == NULL || group->chip == NULL) {
+		perror("malloc");
+		group_end(group);
+		return -1;
+	}
+	group->ls->waitkey = group_waitkey;
+	group->ls->data = group;
+	for (lane = 0; lane < group->count; lane++) {
+		job = group->jobs[lane];
+		if (job_start(job) < 0) {
+			job_finish(job, JOB_FAILED);
+			continue;
+		}
+		chip8_lockstep_set(group->ls, lane, job->chip);
+		free(job->chip);
+		job->chip = NULL;
+	}
+	return 0;
+}
+
+static void lane_finish(struct group *group, size_t lane)
+{
+	struct job *job = group->jobs[lane];
+	chip8_lockstep_get(group->ls, lane, group->chip);
+	job->cycles = group->chip->cycles;
+	job->state_hash = chip8_hash(group->chip);
+	job_finish(job, group->chip->fault != CHIP8_FAULT_NONE
+		? JOB_FAULT : JOB_DONE);
+}
+
+/* The lockstep version of run_frame; returns how many lanes are left */
+static size_t group_frame(struct group *group)
+{
+	struct chip8_lockstep *ls = group->ls;
+	uint64_t rows[CHIP8_DISPLAYH];
+	struct job *job;
+	size_t lane;
+	size_t live = 0;
+	int i;
+
+	for (lane = 0; lane < group->count; lane++) {
+		if (ls->running[lane]) {
+			job = group->jobs[lane];
+			chip8_input_frame(&job->input, job->frames);
+			ls->keys[lane] = job->input.keys;
+		}
+	}
+	for (i = 0; i < BATCH_IPF; i++) {
+		chip8_lockstep_step(ls);
+	}
+	chip8_lockstep_tick(ls);
+	for (lane = 0; lane < group->count; lane++) {
+		job = group->jobs[lane];
+		if (job->status != JOB_RUNNING) {
+			continue;
+		}
+		if (!ls->running[lane]) {
+			lane_finish(group, lane);
+			continue;
+		}
+		job->frames++;
+		for (i = 0; i < CHIP8_DISPLAYH; i++) {
+			rows[i] = ls->display[i][lane];
+		}
+		job->frame_hash = hash_display(job->frame_hash, rows);
+		live++;
+	}
+	return live;
+}
+
+/* Advance a group by one chunk of frames; returns 1 once it is finished */
+static int run_group_chunk(struct batch *batch, struct group *group)
+{
+	size_t lane;
+	size_t live = 1;
+	unsigned long i;
+
+	if (group->ls == NULL && group_start(group) < 0) {
+		for (lane = 0; lane < group->count; lane++) {
+			job_finish(group->jobs[lane], JOB_FAILED);
+		}
+		return 1;
+	}
+	for (i = 0; i < batch->chunk && live > 0
+		&& group->frames < batch->max_frames; i++) {
+		live = group_frame(group);
+		group->frames++;
+	}
+	if (live > 0 && group->frames < batch->max_frames) {
+		return 0;
+	}
+	for (lane = 0; lane < group->count; lane++) {
+		if (group->jobs[lane]->status == JOB_RUNNING) {
+			lane_finish(group, lane);
+		}
+	}
+	group_end(group);
+	return 1;
+}
+
+static int run_unit(struct batch *batch, size_t unit)
+{
+	if (batch->lanes > 0) {
+		return run_group_chunk(batch, &batch->groups[unit]);
+	}
+	return run_chunk(batch, &batch->jobs[unit]);
+}
+
+static int find_work(struct batch *batch, int id, size_t *job)
+{
+	int i;
+	if (deque_pop(&batch->queues[id], job)) {
+		return 1;
+	}
+	for (i = 1; i < batch->nthreads; i++) {
+		if (deque_steal(&batch->queues[(id + i) % batch->nthreads],
+			job)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *worker = arg;
+	struct batch *batch = worker->batch;
+	size_t unit;
+	size_t remaining;
+
+	while (1) {
+		if (!find_work(batch, worker->id, &unit)) {
+			pthread_mutex_lock(&batch->lock);
+			remaining = batch->remaining;
+			pthread_mutex_unlock(&batch->lock);
+			if (remaining == 0) {
+				break;
+			}
+			/* Jobs are in flight on other workers */
+			sched_yield();
+			continue;
+		}
+		if (run_unit(batch, unit)) {
+			pthread_mutex_lock(&batch->lock);
+			batch->remaining--;
+			pthread_mutex_unlock(&batch->lock);
+		} else {
+			deque_push(&batch->queues[worker->id], unit);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Each line of the job list is "ROM [INPUT_SCRIPT [SEED]]"; the script may
+ * be "-" for none, and the seed defaults to the one the script was recorded
+ * with, or else 1
+ */
+static int read_jobs(struct batch *batch, FILE *fp)
+{
+	char line[LINE_BUFSIZE];
+	char rom[LINE_BUFSIZE];
+	char script[LINE_BUFSIZE];
+	unsigned long seed;
+	struct job *jobs;
+	size_t capacity = 0;
+	struct job *job;
+	int fields;
+
+	batch->jobs = NULL;
+	batch->njobs = 0;
+	while (fgets(line, LINE_BUFSIZE, fp) != NULL) {
+		fields = sscanf(line, "%s %s %lu", rom, script, &seed);
+		if (fields < 1 || rom[0] == '#') {
+			continue;
+		}
+		if (batch->njobs == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			jobs = realloc(batch->jobs, capacity * sizeof(*jobs));
+			if (jobs == NULL) {
+				perror("realloc");
+				return -1;
+			}
+			batch->jobs = jobs;
+		}
+		job = &batch->jobs[batch->njobs++];
+		memset(job, 0, sizeof(*job));
+		job->rom = strdup(rom);
+		job->script = fields > 1 && strcmp(script, "-") != 0
+			? strdup(script) : NULL;
+		job->seed = fields > 2 ? seed : 1;
+		job->has_seed = fields > 2;
+		job->status = JOB_RUNNING;
+	}
+	return 0;
+}
+
+static int compare_roms(const void *a, const void *b)
+{
+	const struct job *const *ja = a;
+	const struct job *const *jb = b;
+	return strcmp((*ja)->rom, (*jb)->rom);
+}
+
+/* Sort the jobs by ROM and cut each run of one ROM into groups */
+static int make_groups(struct batch *batch)
+{
+	struct job **order;
+	struct group *group;
+	size_t i;
+
+	order = malloc((batch->njobs + 1) * sizeof(*order));
+	batch->groups = calloc(batch->njobs + 1, sizeof(*batch->groups));
+	if (order == NULL || batch->groups == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	for (i = 0; i < batch->njobs; i++) {
+		order[i] = &batch->jobs[i];
+	}
+	qsort(order, batch->njobs, sizeof(*order), compare_roms);
+	batch->ngroups = 0;
+	for (i = 0; i < batch->njobs; i++) {
+		group = batch->ngroups > 0
+			? &batch->groups[batch->ngroups - 1] : NULL;
+		if (group == NULL || group->count == batch->lanes
+			|| strcmp(group->jobs[0]->rom, order[i]->rom) != 0) {
+			group = &batch->groups[batch->ngroups++];
+			group->jobs = &order[i];
+		}
+		group->count++;
+	}
+	return 0;
+}
+
+/* Returns the number of jobs that faulted or failed */
+static size_t write_results(struct batch *batch, FILE *fp)
+{
+	static const char *status_names[] = {
+		[JOB_RUNNING] = "running",
+		[JOB_DONE] = "done",
+		[JOB_FAULT] = "fault",
+		[JOB_FAILED] = "failed"
+	};
+	struct job *job;
+	size_t failed = 0;
+	size_t i;
+
+	fprintf(fp, "# rom script seed status frames cycles state_hash "
+		"frame_hash\n");
+	for (i = 0; i < batch->njobs; i++) {
+		job = &batch->jobs[i];
+		fprintf(fp, "%s %s %lu %s %lu %lu %016llX %016llX\n",
+			job->rom, job->script ? job->script : "-",
+			(unsigned long) job->seed, status_names[job->status],
+			job->frames, job->cycles,
+			(unsigned long long) job->state_hash,
+			(unsigned long long) job->frame_hash);
+		if (job->status == JOB_FAULT || job->status == JOB_FAILED) {
+			failed++;
+		}
+	}
+	return failed;
+}
+
+static unsigned long parse_count(const char *arg)
+{
+	char *end;
+	unsigned long count = strtoul(arg, &end, 10);
+	if (*arg == '\0' || *end != '\0' || count == 0) {
+		fprintf(stderr, "Not a positive count: %s\n", arg);
+		exit(EXIT_FAILURE);
+	}
+	return count;
+}
+
+int main(int argc, char *argv[])
+{
+	struct batch batch;
+	struct worker *workers;
+	pthread_t *threads;
+	char *output = NULL;
+	FILE *fp;
+	size_t units;
+	size_t failed;
+	extern char *optarg;
+	extern int optind;
+	int opt;
+	size_t i;
+	int started;
+	int t;
+
+	batch.nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	batch.max_frames = DEFAULT_FRAMES;
+	batch.chunk = DEFAULT_CHUNK;
+	batch.lanes = 0;
+	while ((opt = getopt(argc, argv, "j:n:k:L:o:")) > 0) {
+		switch (opt) {
+		case 'j':
+			batch.nthreads = parse_count(optarg);
+			break;
+		case 'n':
+			batch.max_frames = parse_count(optarg);
+			break;
+		case 'k':
+			batch.chunk = parse_count(optarg);
+			break;
+		case 'L':
+			batch.lanes = parse_count(optarg);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			fprintf(stderr, USAGE_FMT, argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, USAGE_FMT, argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if (batch.nthreads < 1) {
+		batch.nthreads = 1;
+	}
+
+	fp = fopen(argv[optind], "r");
+	if (!fp) {
+		perror(argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	if (read_jobs(&batch, fp) < 0) {
+		exit(EXIT_FAILURE);
+	}
+	fclose(fp);
+	units = batch.njobs;
+	if (batch.lanes > 0) {
+		if (make_groups(&batch) < 0) {
+			exit(EXIT_FAILURE);
+		}
+		units = batch.ngroups;
+	}
+
+	batch.queues = calloc(batch.nthreads, sizeof(*batch.queues));
+	workers = calloc(batch.nthreads, sizeof(*workers));
+	threads = calloc(batch.nthreads, sizeof(*threads));
+	if (!batch.queues || !workers || !threads) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (t = 0; t < batch.nthreads; t++) {
+		pthread_mutex_init(&batch.queues[t].lock, NULL);
+		batch.queues[t].capacity = units + 1;
+		batch.queues[t].slots = calloc(units + 1,
+			sizeof(size_t));
+		if (batch.queues[t].slots == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < units; i++) {
+		deque_push(&batch.queues[i % batch.nthreads], i);
+	}
+	pthread_mutex_init(&batch.lock, NULL);
+	batch.remaining = units;
+
+	for (t = 0; t < batch.nthreads; t++) {
+		workers[t].batch = &batch;
+		workers[t].id = t;
+	}
+	/* Workers steal from every queue, so those that start do it all */
+	for (started = 0; started < batch.nthreads; started++) {
+		if (pthread_create(&threads[started], NULL, worker_main,
+			&workers[started]) != 0) {
+			fprintf(stderr, "Failed to start a worker thread\n");
+			break;
+		}
+	}
+	if (started == 0) {
+		worker_main(&workers[0]);
+	}
+	for (t = 0; t < started; t++) {
+		pthread_join(threads[t], NULL);
+	}
+
+	fp = output ? fopen(output, "w") : stdout;
+	if (!fp) {
+		perror(output);
+		exit(EXIT_FAILURE);
+	}
+	failed = write_results(&batch, fp);
+	if (output) {
+		fclose(fp);
+	}
+	return failed > 0 ? EXIT_FAILURE : 0;
+}
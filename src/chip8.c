@@ -10,6 +10,13 @@
 
 #include "chip8.h"
 #include "instructions.h"
+#include "dispatch.h"
+#include "fuse.h"
+#include "idle.h"
+#include "threaded.h"
+#include "jit.h"
+#include "aot.h"
+#include "profile.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,6 +24,17 @@
 
 #define LOAD_BUFSIZE 512
 
+const char *chip8_fault_names[CHIP8_FAULT_COUNT] = {
+	[CHIP8_FAULT_NONE] = "No fault",
+	[CHIP8_FAULT_BAD_INSTRUCTION] = "Bad instruction",
+	[CHIP8_FAULT_BAD_JUMP] = "Invalid jump",
+	[CHIP8_FAULT_BAD_SPRITE] = "Invalid sprite length",
+	[CHIP8_FAULT_BAD_DRAW] = "Invalid draw address",
+	[CHIP8_FAULT_BAD_READ] = "Invalid memory read",
+	[CHIP8_FAULT_BAD_WRITE] = "Invalid memory write",
+	[CHIP8_FAULT_STACK] = "Stack overflow or underflow"
+};
+
 void chip8_init(struct chip8 *chip, struct chip8_keyboard *keyboard,
 	struct chip8_renderer *renderer,
 	void (*check_kill)(struct chip8 *chip))
@@ -45,17 +63,14 @@ void chip8_init(struct chip8 *chip, struct chip8_keyboard *keyboard,
 
 	memset(chip->reg_v, 0, CHIP8_REGCOUNT);
 	chip->reg_i = 0x00;
-	chip->reg_dt = 0x0;
-	chip->reg_st = 0x00;
+	chip->ticks = 0;
+	chip->dt_expiry = 0;
+	chip->st_expiry = 0;
 	memset(chip->ram, 0, CHIP8_RAMBYTES);
 	chip->pc = 0;
 	chip->sp = 0;
 	memset(chip->stack, 0, CHIP8_STACKSIZE * sizeof(unsigned short));
-	for (i = 0 ; i < CHIP8_DISPLAYH; i++) {
-		for (j = 0; j < CHIP8_DISPLAYW; j++) {
-			chip8_setpixel(chip, j, i, 0x0);
-		}
-	}
+	memset(chip->display, 0, sizeof(chip->display));
 	for (i = 0; i < 16; i++) {
 		for (j = 0; j < 5; j++) {
 			addr = CHIP8_FONTSTART + i * CHIP8_FONTWIDTH + j;
@@ -65,9 +80,26 @@ void chip8_init(struct chip8 *chip, struct chip8_keyboard *keyboard,
 	chip->keyboard = keyboard;
 	chip->renderer = renderer;
 	chip->is_halted = 0;
+	chip->fault = CHIP8_FAULT_NONE;
 	chip->check_kill = check_kill;
+	chip->display_dirty = 1;
+	chip->frame_pending = 0;
+	chip->engine = CHIP8_ENGINE_TABLE;
+	chip->cycles = 0;
+	chip->fusion_enabled = 1;
+	memset(chip->fusion_hits, 0, sizeof(chip->fusion_hits));
+	chip->idle_until = 0;
+	chip->idle = NULL;
+	chip->idle_cycles = 0;
+	chip->idle_waits = 0;
+	chip->key_wait = 0;
+	chip->dirty_pages = 0;
+	chip->snapshot_serial = 0;
+	chip->profile = NULL;
+	memset(chip->icache, 0, sizeof(chip->icache));
+	chip8_dispatch_init();
 	now = time(NULL);
-	srand(now);
+	chip8_seed(chip, now);
 }
 
 int chip8_load(struct chip8 *chip, char *file_name)
@@ -83,17 +115,41 @@ int chip8_load(struct chip8 *chip, char *file_name)
 	while ((count = fread(&buf, 1, LOAD_BUFSIZE, fp)) > 0) {
 		if (next + count > CHIP8_RAMBYTES) {
 			fprintf(stderr, "Program is too long\n");
-			abort();
+			fclose(fp);
+			return -1;
 		}
 		memmove(chip->ram + next, buf, count);
+		next += count;
 	}	
 	fclose(fp);
+	chip8_icache_fill(chip);
+	chip->snapshot_serial = 0;
 	return 0;
 }
 
 void chip8_exec(struct chip8 *chip)
 {
 	chip->pc = CHIP8_PROGSTART;
+	if (chip->engine == CHIP8_ENGINE_THREADED) {
+		chip8_exec_threaded(chip);
+		return;
+	} else if (chip->engine == CHIP8_ENGINE_JIT) {
+		chip8_exec_jit(chip);
+		return;
+	} else if (chip->engine == CHIP8_ENGINE_AOT) {
+		chip8_exec_aot(chip);
+		chip8_halt(chip);
+		return;
+	} else if (chip->engine == CHIP8_ENGINE_PROFILE) {
+		chip8_exec_profiled(chip);
+		return;
+	}
+	chip8_interpret(chip);
+}
+
+/* Run instructions one at a time from the current PC until halted */
+void chip8_interpret(struct chip8 *chip)
+{
 	while (chip->pc + 2 < CHIP8_RAMBYTES && !chip->is_halted) {
 		if (chip8_exec_instruction(chip) < 0) {
 			break;
@@ -104,11 +160,33 @@ void chip8_exec(struct chip8 *chip)
 
 int chip8_exec_instruction(struct chip8 *chip)
 {
-	unsigned short ins = chip8_next_instruction(chip, 1);
-	if (chip8_decode(chip, ins) != 0) {
-		return -1;
+	struct chip8_decoded *d = chip8_decoded_at(chip, chip->pc);
+	int retired = 1;
+	if (d->idle != CHIP8_IDLE_NONE && chip8_idle(chip, d)) {
+		/* A wait loop was skipped, and counted, or waited on */
+		retired = 0;
+	} else {
+		chip->pc += 2;
+		/* A fused sequence must not run past the next frame boundary */
+		if (d->fuse != CHIP8_FUSE_NONE && chip->fusion_enabled
+			&& chip->idle_until - chip->cycles
+				>= CHIP8_FUSE_MAXLEN) {
+			retired = chip8_exec_fused(chip, d);
+			if (retired < 0) {
+				return -1;
+			}
+			/* A taken skip before a CALL runs the skip alone */
+			if (retired > 1) {
+				chip->fusion_hits[d->fuse]++;
+			}
+		} else if (d->handler(chip, d->ins) != 0) {
+			return -1;
+		}
+	}
+	chip->cycles += retired;
+	if (chip->frame_pending) {
+		chip8_present(chip);
 	}
-	chip->renderer->render_display(chip);
 	chip->check_kill(chip);
 	return 0;
 }
@@ -126,110 +204,74 @@ unsigned short chip8_next_instruction(struct chip8 *chip, int inc_pc)
 
 int chip8_decode(struct chip8 *chip, unsigned short ins)
 {
-	byte nibble_h;
-	byte y;
-	byte n;
-
-	nibble_h = (ins & 0xF000) >> 12;
-	if (nibble_h == 0x0) {
-		y = ins & 0x00FF;
-		if (y == 0x00) {
-			/* NOP */
-		} else if (y == 0xE0) {
-			chip8_cls(chip);
-		} else if (y == 0xEE) {
-			chip8_ret(chip);
-		} else if (y == 0xFD) {
-			/* EXIT */
-			return 1;
-		} else {
-			fprintf(stderr, "Unrecognized instruction: 0x%04X\n",
-				ins);
-		}
-	} else if (nibble_h == 0x1) {
-		chip8_jump(chip, ins);
-	} else if (nibble_h == 0x2) {
-		chip8_call(chip, ins);
-	} else if (nibble_h == 0x3) {
-		chip8_se_immediate(chip, ins);
-	} else if (nibble_h == 0x4) {
-		chip8_sne_immediate(chip, ins);
-	} else if (nibble_h == 0x5) {
-		chip8_se(chip, ins);
-	} else if (nibble_h == 0x6) {
-		chip8_load_immediate(chip, ins);
-	} else if (nibble_h == 0x7) {
-		chip8_add_immediate(chip, ins);
-	} else if (nibble_h == 0x8) {
-		n = ins & 0x000F;
-		if (n == 0x0) {
-			chip8_ld(chip, ins);
-		} else if (n == 0x1) {
-			chip8_or(chip, ins);
-		} else if (n == 0x2) {
-			chip8_and(chip, ins);
-		} else if (n == 0x4) {
-			chip8_add(chip, ins);
-		} else if (n == 0x5) {
-			chip8_sub(chip, ins);
-		} else if (n == 0x6) {
-			chip8_shr(chip, ins);
-		} else if (n == 0x7) {
-			chip8_subn(chip, ins);
-		} else if (n == 0xE) {
-			chip8_shl(chip, ins);
-		} else {
-			fprintf(stderr, "Not Implemented: 0x%04X\n", ins);
-			abort();
-		}
-	} else if (nibble_h == 0x9) {
-		chip8_sne(chip, ins);
-	} else if (nibble_h == 0xA) {
-		chip8_load_i(chip, ins);
-	} else if (nibble_h == 0xB) {
-		chip8_jump_add(chip, ins);
-	} else if (nibble_h == 0xC) {
-		chip8_rnd(chip, ins);
-	} else if (nibble_h == 0xD) {
-		chip8_draw(chip, ins);
-	} else if (nibble_h == 0xE) {
-		n = (ins & 0x00FF);
-		if (n == 0x9E) {
-			chip8_skp(chip, ins);
-		} else if (n == 0xA1) {
-			chip8_sknp(chip, ins);
-		} else {
-			fprintf(stderr, "Bad instruction: 0x%04X\n", ins);
-			abort();
-		}
-	} else if (nibble_h == 0xF) {
-		y = ins & 0x00FF;
-		if (y == 0x07) {
-			chip8_load_from_dt(chip, ins);
-		} else if (y == 0x0A) {
-			chip8_waitkey(chip, ins);
-		} else if (y == 0x15) {
-			chip8_load_dt(chip, ins);
-		} else if (y == 0x18) {
-			chip8_load_st(chip, ins);
-		} else if (y == 0x29) {
-			chip8_load_i_hexfont(chip, ins);
-		} else if (y == 0x33) {
-			chip8_store_bcd(chip, ins);
-		} else if (y == 0x55) {
-			chip8_store_range_from_i(chip, ins);
-		} else if (y == 0x65) {
-			chip8_load_range_from_i(chip, ins);
-		} else {
-			fprintf(stderr, "Unrecognized instruction: 0x%04X\n",
-				ins);
-		}
-	} else {
-		fprintf(stderr, "Unrecognized instruction: 0x%04X\n", ins);
-		abort();
+	return chip8_dispatch_table[ins](chip, ins);
+}
+
+static void decode_at(struct chip8 *chip, unsigned short addr)
+{
+	struct chip8_decoded *d = &chip->icache[addr];
+	unsigned short ins = chip->ram[addr] << 8;
+	if (addr + 1 < CHIP8_RAMBYTES) {
+		ins |= chip->ram[addr + 1];
 	}
+	d->ins = ins;
+	d->nnn = ins & 0x0FFF;
+	d->op = chip8_op_table[ins];
+	d->x = (ins & 0x0F00) >> 8;
+	d->y = (ins & 0x00F0) >> 4;
+	d->kk = ins & 0x00FF;
+	d->handler = chip8_dispatch_table[ins];
+	d->fuse = chip8_fuse_match(chip, addr);
+	d->idle = chip8_idle_match(chip, addr);
+}
 
-	return 0;
+struct chip8_decoded *chip8_decoded_at(struct chip8 *chip,
+	unsigned short addr)
+{
+	struct chip8_decoded *d = &chip->icache[addr];
+	if (d->handler == NULL) {
+		decode_at(chip, addr);
+	}
+	return d;
+}
+
+/* Fetch the decoded instruction at PC and advance PC past it */
+struct chip8_decoded *chip8_fetch(struct chip8 *chip)
+{
+	struct chip8_decoded *d = chip8_decoded_at(chip, chip->pc);
+	chip->pc += 2;
+	return d;
+}
+
+void chip8_icache_fill(struct chip8 *chip)
+{
+	unsigned short addr;
+	for (addr = 0; addr < CHIP8_RAMBYTES; addr++) {
+		decode_at(chip, addr);
+	}
+}
+
+/*
+ * Drop cached decodings overlapping the written range [addr, addr + len),
+ * including any superinstruction whose tail reaches into it
+ */
+void chip8_icache_invalidate(struct chip8 *chip, unsigned short addr,
+	unsigned short len)
+{
+	unsigned int reach = CHIP8_FUSE_MAXLEN * 2 - 1;
+	unsigned int start = addr > reach ? addr - reach : 0;
+	unsigned int end = addr + len;
+	unsigned int i;
+	if (end > CHIP8_RAMBYTES) {
+		end = CHIP8_RAMBYTES;
+	}
+	for (i = start; i < end; i++) {
+		chip->icache[i].handler = NULL;
+	}
+	/* Every write to RAM comes through here, so it also marks the pages */
+	for (i = addr / CHIP8_PAGEBYTES; i * CHIP8_PAGEBYTES < end; i++) {
+		chip->dirty_pages |= (uint32_t) 1 << i;
+	}
 }
 
 int chip8_setv(struct chip8 *chip, byte index, byte value)
@@ -249,17 +291,144 @@ void chip8_setvf(struct chip8 *chip, byte val)
 	chip->reg_v[0xF] = val;
 }
 
+#define PIXEL_MASK(x) ((uint64_t) 1 << (CHIP8_DISPLAYW - 1 - (x)))
+
 void chip8_setpixel(struct chip8 *chip, byte x, byte y, byte val)
 {
-	chip->display[y][x] = val;
+	if (val) {
+		chip->display[y] |= PIXEL_MASK(x);
+	} else {
+		chip->display[y] &= ~PIXEL_MASK(x);
+	}
 }
 
 byte chip8_getpixel(struct chip8 *chip, byte x, byte y)
 {
-	return chip->display[y][x];
+	return (chip->display[y] & PIXEL_MASK(x)) != 0;
+}
+
+/* The packed pixels of row y; bit 63 is x = 0 */
+uint64_t chip8_display_row(struct chip8 *chip, byte y)
+{
+	return chip->display[y];
+}
+
+/*
+ * The timers are kept as the tick they run out at, so nothing counts them
+ * down: time passing is one add however many ticks it is, and a timer's
+ * value is only worked out when something reads it
+ */
+unsigned int chip8_getdt(struct chip8 *chip)
+{
+	return chip->dt_expiry > chip->ticks
+		? chip->dt_expiry - chip->ticks : 0;
+}
+
+unsigned int chip8_getst(struct chip8 *chip)
+{
+	return chip->st_expiry > chip->ticks
+		? chip->st_expiry - chip->ticks : 0;
+}
+
+void chip8_setdt(struct chip8 *chip, unsigned int value)
+{
+	chip->dt_expiry = chip->ticks + value;
+}
+
+void chip8_setst(struct chip8 *chip, unsigned int value)
+{
+	chip->st_expiry = chip->ticks + value;
+}
+
+/* Let ticks 60 Hz ticks of the machine's time pass */
+void chip8_tick(struct chip8 *chip, unsigned long ticks)
+{
+	chip->ticks += ticks;
+}
+
+/* Each machine draws RND values from its own generator */
+void chip8_seed(struct chip8 *chip, uint32_t seed)
+{
+	/* xorshift never leaves the all-zero state */
+	chip->rand_state = seed ? seed : 0x2545F491;
+}
+
+uint32_t chip8_xorshift(uint32_t r)
+{
+	r ^= r << 13;
+	r ^= r >> 17;
+	r ^= r << 5;
+	return r;
+}
+
+byte chip8_random(struct chip8 *chip)
+{
+	chip->rand_state = chip8_xorshift(chip->rand_state);
+	return chip->rand_state >> 24;
+}
+
+/* The lowest key whose bit is set in keys, or CHIP8_KEY_NONE */
+byte chip8_lowest_key(unsigned short keys)
+{
+	byte key;
+	for (key = 0; key <= 0xF; key++) {
+		if (keys >> key & 0x1) {
+			return key;
+		}
+	}
+	return CHIP8_KEY_NONE;
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	const byte *p = data;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+/* FNV-1a over the architectural state, for comparing runs */
+uint64_t chip8_hash(struct chip8 *chip)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	unsigned int dt = chip8_getdt(chip);
+	unsigned int st = chip8_getst(chip);
+	hash = fnv1a(hash, chip->reg_v, sizeof(chip->reg_v));
+	hash = fnv1a(hash, &chip->reg_i, sizeof(chip->reg_i));
+	hash = fnv1a(hash, &chip->pc, sizeof(chip->pc));
+	hash = fnv1a(hash, &chip->sp, sizeof(chip->sp));
+	hash = fnv1a(hash, chip->stack, sizeof(chip->stack));
+	hash = fnv1a(hash, &dt, sizeof(dt));
+	hash = fnv1a(hash, &st, sizeof(st));
+	hash = fnv1a(hash, chip->ram, sizeof(chip->ram));
+	hash = fnv1a(hash, chip->display, sizeof(chip->display));
+	return hash;
+}
+
+/*
+ * Called once per frame by whoever keeps the 60 Hz clock; only redraws when
+ * DRW or CLS changed the display since the last frame
+ */
+void chip8_present(struct chip8 *chip)
+{
+	chip->frame_pending = 0;
+	if (chip->display_dirty) {
+		chip->display_dirty = 0;
+		chip->renderer->render_display(chip);
+	}
 }
 
 void chip8_halt(struct chip8 *chip)
 {
 	chip->is_halted = 1;
 }
+
+/* Record why the machine stopped; returns -1 for the handler to return */
+int chip8_fault(struct chip8 *chip, enum chip8_fault fault)
+{
+	chip->fault = fault;
+	return -1;
+}
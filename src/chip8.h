@@ -11,6 +11,8 @@
 #ifndef CHIP8_H
 #define CHIP8_H
 
+#include <stdint.h>
+
 #define TO_BIG_ENDIAN(x) (((x) >> 8 & 0x00FF) | ((x) << 8 & 0xFF00))
 
 #define CHIP8_REGCOUNT 16
@@ -22,19 +24,90 @@
 #define CHIP8_DISPLAYW 64
 #define CHIP8_FONTSTART 0x0
 #define CHIP8_FONTWIDTH 5
+#define CHIP8_FUSE_MAXLEN 3
+#define CHIP8_PAGEBYTES 256
+#define CHIP8_PAGES (CHIP8_RAMBYTES / CHIP8_PAGEBYTES)
+/* What waitkey returns when no key has been pressed yet */
+#define CHIP8_KEY_NONE 0xFF
 
 typedef unsigned char byte;
 
+enum chip8_engine {
+	CHIP8_ENGINE_TABLE,
+	CHIP8_ENGINE_THREADED,
+	CHIP8_ENGINE_JIT,
+	CHIP8_ENGINE_AOT,
+	CHIP8_ENGINE_PROFILE
+};
+
+/* Superinstructions: common sequences executed as one handler */
+enum chip8_fusion {
+	CHIP8_FUSE_NONE,
+	CHIP8_FUSE_LD_SUB,
+	CHIP8_FUSE_LD_SUB_RET,
+	CHIP8_FUSE_LD_SKP,
+	CHIP8_FUSE_SKIP_CALL,
+	CHIP8_FUSE_LD_I_DRW,
+	CHIP8_FUSE_LD_I_DRW_RET,
+	CHIP8_FUSE_COUNT
+};
+
+/* Loops that only wait for a timer or a key, which can be skipped */
+enum chip8_idle {
+	CHIP8_IDLE_NONE,
+	CHIP8_IDLE_JP, /* JP to itself */
+	CHIP8_IDLE_DT_SE, /* LD Vx, DT; SE Vx, kk; JP back */
+	CHIP8_IDLE_DT_SNE, /* LD Vx, DT; SNE Vx, kk; JP back */
+	CHIP8_IDLE_SKP, /* SKP Vx; JP back */
+	CHIP8_IDLE_SKNP, /* SKNP Vx; JP back */
+	CHIP8_IDLE_KEY, /* LD Vx, K, trying again until a key comes */
+	CHIP8_IDLE_COUNT
+};
+
+/* Why a handler stopped the machine; the handlers return -1 after one */
+enum chip8_fault {
+	CHIP8_FAULT_NONE,
+	CHIP8_FAULT_BAD_INSTRUCTION,
+	CHIP8_FAULT_BAD_JUMP,
+	CHIP8_FAULT_BAD_SPRITE,
+	CHIP8_FAULT_BAD_DRAW,
+	CHIP8_FAULT_BAD_READ,
+	CHIP8_FAULT_BAD_WRITE,
+	CHIP8_FAULT_STACK, /* CALL on a full stack or RET on an empty one */
+	CHIP8_FAULT_COUNT
+};
+
+extern const char *chip8_fault_names[CHIP8_FAULT_COUNT];
+
 struct chip8;
+struct chip8_profile;
 
 struct chip8_renderer {
 	void *data;
 	void (*render_display)(struct chip8 *chip);
 };
 
+/*
+ * waitkey must not block: it returns the key that ended the wait, or
+ * CHIP8_KEY_NONE to have LD Vx, K run again until one does
+ */
 struct chip8_keyboard {
-	byte (*waitkey)();
-	int (*is_key_down)(byte keyval);
+	void *data;
+	byte (*waitkey)(struct chip8 *chip);
+	int (*is_key_down)(struct chip8 *chip, byte keyval);
+};
+
+/* An instruction decoded ahead of time, cached per RAM address */
+struct chip8_decoded {
+	int (*handler)(struct chip8 *chip, unsigned short ins);
+	unsigned short ins;
+	unsigned short nnn;
+	byte op;
+	byte x;
+	byte y;
+	byte kk;
+	byte fuse;
+	byte idle;
 };
 
 struct chip8 {
@@ -42,15 +115,33 @@ struct chip8 {
 	unsigned int reg_i;
 	byte ram[CHIP8_RAMBYTES];
 	unsigned short pc;
-	unsigned int reg_dt;
-	unsigned int reg_st;
+	unsigned long ticks; /* 60 Hz timer ticks, in machine time */
+	unsigned long dt_expiry; /* The tick DT reaches 0 at */
+	unsigned long st_expiry;
 	unsigned short sp;
 	unsigned short stack[CHIP8_STACKSIZE];
 	struct chip8_keyboard *keyboard;
-	byte display[CHIP8_DISPLAYH][CHIP8_DISPLAYW];
+	uint64_t display[CHIP8_DISPLAYH]; /* One word per row, MSB leftmost */
 	struct chip8_renderer *renderer;
 	int is_halted;
+	enum chip8_fault fault; /* The faulting instruction is at pc - 2 */
 	void (*check_kill)(struct chip8 *chip);
+	uint32_t rand_state;
+	int display_dirty;
+	volatile int frame_pending;
+	enum chip8_engine engine;
+	unsigned long cycles;
+	int fusion_enabled;
+	unsigned long fusion_hits[CHIP8_FUSE_COUNT];
+	unsigned long idle_until; /* Cycle count the timers or keys change at */
+	void (*idle)(struct chip8 *chip); /* Waits for them in real time */
+	unsigned long idle_cycles; /* Instructions skipped in wait loops */
+	unsigned long idle_waits; /* Times chip->idle was called */
+	int key_wait; /* LD Vx, K at pc found no key last time it ran */
+	uint32_t dirty_pages; /* RAM pages written since snapshot_serial */
+	unsigned long snapshot_serial;
+	struct chip8_profile *profile; /* Counters for CHIP8_ENGINE_PROFILE */
+	struct chip8_decoded icache[CHIP8_RAMBYTES];
 };
 
 void chip8_init(struct chip8 *chip, struct chip8_keyboard *keyboard,
@@ -58,13 +149,33 @@ void chip8_init(struct chip8 *chip, struct chip8_keyboard *keyboard,
 	void (*check_kill)(struct chip8 *chip));
 int chip8_load(struct chip8 *chip, char *file_name);
 void chip8_exec(struct chip8 *chip);
+void chip8_interpret(struct chip8 *chip);
 int chip8_exec_instruction(struct chip8 *chip);
 unsigned short chip8_next_instruction(struct chip8 *chip, int inc_pc);
 int chip8_decode(struct chip8 *chip, unsigned short ins);
+struct chip8_decoded *chip8_decoded_at(struct chip8 *chip,
+	unsigned short addr);
+struct chip8_decoded *chip8_fetch(struct chip8 *chip);
+void chip8_icache_fill(struct chip8 *chip);
+void chip8_icache_invalidate(struct chip8 *chip, unsigned short addr,
+	unsigned short len);
 int chip8_setv(struct chip8 *chip, byte index, byte value);
 void chip8_setvf(struct chip8 *chip, byte val);
 void chip8_setpixel(struct chip8 *chip, byte x, byte y, byte val);
 byte chip8_getpixel(struct chip8 *chip, byte x, byte y);
+uint64_t chip8_display_row(struct chip8 *chip, byte y);
+unsigned int chip8_getdt(struct chip8 *chip);
+unsigned int chip8_getst(struct chip8 *chip);
+void chip8_setdt(struct chip8 *chip, unsigned int value);
+void chip8_setst(struct chip8 *chip, unsigned int value);
+void chip8_tick(struct chip8 *chip, unsigned long ticks);
+void chip8_seed(struct chip8 *chip, uint32_t seed);
+uint32_t chip8_xorshift(uint32_t r);
+byte chip8_random(struct chip8 *chip);
+byte chip8_lowest_key(unsigned short keys);
+uint64_t chip8_hash(struct chip8 *chip);
+void chip8_present(struct chip8 *chip);
 void chip8_halt(struct chip8 *chip);
+int chip8_fault(struct chip8 *chip, enum chip8_fault fault);
 
 #endif /* CHIP8_H */
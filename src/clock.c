@@ -0,0 +1,123 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+/*
+ * The frame clock is a periodic timerfd armed at an absolute time, so the
+ * kernel counts every period that has passed and a late reader loses no
+ * frames and gains no drift. Checking whether a frame is due reads the
+ * clock and compares it with the next deadline, which costs no system
+ * call; waiting for one sleeps in epoll on the timer.
+ */
+
+#include "clock.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define NSEC_PER_SEC 1000000000L
+
+static void advance(struct timespec *ts, long long ns)
+{
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / NSEC_PER_SEC;
+	ts->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+static int before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec
+		|| (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* Start a clock with hz frames a second; the first starts one period on */
+int chip8_clock_init(struct chip8_clock *clock, unsigned int hz)
+{
+	struct itimerspec spec;
+	struct epoll_event event;
+
+	clock->period = NSEC_PER_SEC / hz;
+	clock->frames = 0;
+	clock->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+		TFD_NONBLOCK | TFD_CLOEXEC);
+	if (clock->timer_fd < 0) {
+		perror("timerfd_create");
+		return -1;
+	}
+	clock->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (clock->epoll_fd < 0) {
+		perror("epoll_create1");
+		close(clock->timer_fd);
+		return -1;
+	}
+	event.events = EPOLLIN;
+	event.data.fd = clock->timer_fd;
+	clock_gettime(CLOCK_MONOTONIC, &clock->next);
+	advance(&clock->next, clock->period);
+	spec.it_value = clock->next;
+	spec.it_interval.tv_sec = 0;
+	spec.it_interval.tv_nsec = clock->period;
+	if (epoll_ctl(clock->epoll_fd, EPOLL_CTL_ADD, clock->timer_fd,
+		&event) < 0 || timerfd_settime(clock->timer_fd,
+		TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+		perror("timerfd");
+		chip8_clock_free(clock);
+		return -1;
+	}
+	return 0;
+}
+
+void chip8_clock_free(struct chip8_clock *clock)
+{
+	close(clock->epoll_fd);
+	close(clock->timer_fd);
+}
+
+/*
+ * How many frames have started since the last call. With block set, sleep
+ * until at least one has; otherwise 0 if none is due yet.
+ */
+unsigned long chip8_clock_poll(struct chip8_clock *clock, int block)
+{
+	struct epoll_event event;
+	struct timespec now;
+	uint64_t expired;
+
+	if (!block) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (before(&now, &clock->next)) {
+			return 0;
+		}
+	}
+	while (1) {
+		if (read(clock->timer_fd, &expired, sizeof(expired))
+			== sizeof(expired)) {
+			break;
+		}
+		/* Due by the clock, but the timer has not been run yet */
+		if (!block && errno == EAGAIN) {
+			return 0;
+		}
+		if (errno != EAGAIN && errno != EINTR) {
+			perror("timerfd");
+			return 0;
+		}
+		if (epoll_wait(clock->epoll_fd, &event, 1, -1) < 0
+			&& errno != EINTR) {
+			perror("epoll_wait");
+			return 0;
+		}
+	}
+	clock->frames += expired;
+	advance(&clock->next, clock->period * (long long) expired);
+	return expired;
+}
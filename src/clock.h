@@ -0,0 +1,34 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <time.h>
+
+#define CHIP8_CLOCK_HZ 60
+
+/*
+ * A frame clock on absolute deadlines: frame n starts n periods after the
+ * clock did, however late anybody gets around to asking
+ */
+struct chip8_clock {
+	int timer_fd;
+	int epoll_fd;
+	long period; /* Nanoseconds */
+	struct timespec next; /* When the next frame starts */
+	unsigned long frames; /* Frames started so far */
+};
+
+int chip8_clock_init(struct chip8_clock *clock, unsigned int hz);
+void chip8_clock_free(struct chip8_clock *clock);
+unsigned long chip8_clock_poll(struct chip8_clock *clock, int block);
+
+#endif /* CLOCK_H */
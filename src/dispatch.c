@@ -0,0 +1,208 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#include "dispatch.h"
+#include "instructions.h"
+#include <pthread.h>
+
+chip8_handler chip8_dispatch_table[CHIP8_OPCODES];
+byte chip8_op_table[CHIP8_OPCODES];
+
+const chip8_handler chip8_op_handlers[CHIP8_OP_COUNT] = {
+	[CHIP8_OP_NOP] = chip8_nop,
+	[CHIP8_OP_CLS] = chip8_cls,
+	[CHIP8_OP_RET] = chip8_ret,
+	[CHIP8_OP_EXIT] = chip8_exit,
+	[CHIP8_OP_JP] = chip8_jump,
+	[CHIP8_OP_CALL] = chip8_call,
+	[CHIP8_OP_SE_IMM] = chip8_se_immediate,
+	[CHIP8_OP_SNE_IMM] = chip8_sne_immediate,
+	[CHIP8_OP_SE] = chip8_se,
+	[CHIP8_OP_LD_IMM] = chip8_load_immediate,
+	[CHIP8_OP_ADD_IMM] = chip8_add_immediate,
+	[CHIP8_OP_LD] = chip8_ld,
+	[CHIP8_OP_OR] = chip8_or,
+	[CHIP8_OP_AND] = chip8_and,
+	[CHIP8_OP_ADD] = chip8_add,
+	[CHIP8_OP_SUB] = chip8_sub,
+	[CHIP8_OP_SHR] = chip8_shr,
+	[CHIP8_OP_SUBN] = chip8_subn,
+	[CHIP8_OP_SHL] = chip8_shl,
+	[CHIP8_OP_SNE] = chip8_sne,
+	[CHIP8_OP_LD_I] = chip8_load_i,
+	[CHIP8_OP_JP_V0] = chip8_jump_add,
+	[CHIP8_OP_RND] = chip8_rnd,
+	[CHIP8_OP_DRW] = chip8_draw,
+	[CHIP8_OP_SKP] = chip8_skp,
+	[CHIP8_OP_SKNP] = chip8_sknp,
+	[CHIP8_OP_LD_VX_DT] = chip8_load_from_dt,
+	[CHIP8_OP_LD_VX_K] = chip8_waitkey,
+	[CHIP8_OP_LD_DT_VX] = chip8_load_dt,
+	[CHIP8_OP_LD_ST_VX] = chip8_load_st,
+	[CHIP8_OP_LD_F_VX] = chip8_load_i_hexfont,
+	[CHIP8_OP_LD_B_VX] = chip8_store_bcd,
+	[CHIP8_OP_LD_I_VX] = chip8_store_range_from_i,
+	[CHIP8_OP_LD_VX_I] = chip8_load_range_from_i,
+	[CHIP8_OP_UNKNOWN] = chip8_unknown,
+	[CHIP8_OP_INVALID] = chip8_invalid
+};
+
+/* One word each, so they can go in a folded stack */
+const char *chip8_op_names[CHIP8_OP_COUNT] = {
+	[CHIP8_OP_NOP] = "nop",
+	[CHIP8_OP_CLS] = "cls",
+	[CHIP8_OP_RET] = "ret",
+	[CHIP8_OP_EXIT] = "exit",
+	[CHIP8_OP_JP] = "jp",
+	[CHIP8_OP_CALL] = "call",
+	[CHIP8_OP_SE_IMM] = "se_imm",
+	[CHIP8_OP_SNE_IMM] = "sne_imm",
+	[CHIP8_OP_SE] = "se",
+	[CHIP8_OP_LD_IMM] = "ld_imm",
+	[CHIP8_OP_ADD_IMM] = "add_imm",
+	[CHIP8_OP_LD] = "ld",
+	[CHIP8_OP_OR] = "or",
+	[CHIP8_OP_AND] = "and",
+	[CHIP8_OP_ADD] = "add",
+	[CHIP8_OP_SUB] = "sub",
+	[CHIP8_OP_SHR] = "shr",
+	[CHIP8_OP_SUBN] = "subn",
+	[CHIP8_OP_SHL] = "shl",
+	[CHIP8_OP_SNE] = "sne",
+	[CHIP8_OP_LD_I] = "ld_i",
+	[CHIP8_OP_JP_V0] = "jp_v0",
+	[CHIP8_OP_RND] = "rnd",
+	[CHIP8_OP_DRW] = "drw",
+	[CHIP8_OP_SKP] = "skp",
+	[CHIP8_OP_SKNP] = "sknp",
+	[CHIP8_OP_LD_VX_DT] = "ld_vx_dt",
+	[CHIP8_OP_LD_VX_K] = "ld_vx_k",
+	[CHIP8_OP_LD_DT_VX] = "ld_dt_vx",
+	[CHIP8_OP_LD_ST_VX] = "ld_st_vx",
+	[CHIP8_OP_LD_F_VX] = "ld_f_vx",
+	[CHIP8_OP_LD_B_VX] = "ld_b_vx",
+	[CHIP8_OP_LD_I_VX] = "ld_i_vx",
+	[CHIP8_OP_LD_VX_I] = "ld_vx_i",
+	[CHIP8_OP_UNKNOWN] = "unknown",
+	[CHIP8_OP_INVALID] = "invalid"
+};
+
+static pthread_once_t dispatch_once = PTHREAD_ONCE_INIT;
+
+static void build_dispatch_table(void)
+{
+	unsigned int ins;
+	enum chip8_op op;
+	for (ins = 0; ins < CHIP8_OPCODES; ins++) {
+		op = chip8_op_decode(ins);
+		chip8_op_table[ins] = op;
+		chip8_dispatch_table[ins] = chip8_op_handlers[op];
+	}
+}
+
+/* Build the opcode tables; safe to call any number of times */
+void chip8_dispatch_init(void)
+{
+	pthread_once(&dispatch_once, build_dispatch_table);
+}
+
+enum chip8_op chip8_op_decode(unsigned short ins)
+{
+	switch ((ins & 0xF000) >> 12) {
+	case 0x0:
+		switch (ins & 0x00FF) {
+		case 0x00:
+			return CHIP8_OP_NOP;
+		case 0xE0:
+			return CHIP8_OP_CLS;
+		case 0xEE:
+			return CHIP8_OP_RET;
+		case 0xFD:
+			return CHIP8_OP_EXIT;
+		default:
+			return CHIP8_OP_UNKNOWN;
+		}
+	case 0x1:
+		return CHIP8_OP_JP;
+	case 0x2:
+		return CHIP8_OP_CALL;
+	case 0x3:
+		return CHIP8_OP_SE_IMM;
+	case 0x4:
+		return CHIP8_OP_SNE_IMM;
+	case 0x5:
+		return CHIP8_OP_SE;
+	case 0x6:
+		return CHIP8_OP_LD_IMM;
+	case 0x7:
+		return CHIP8_OP_ADD_IMM;
+	case 0x8:
+		switch (ins & 0x000F) {
+		case 0x0:
+			return CHIP8_OP_LD;
+		case 0x1:
+			return CHIP8_OP_OR;
+		case 0x2:
+			return CHIP8_OP_AND;
+		case 0x4:
+			return CHIP8_OP_ADD;
+		case 0x5:
+			return CHIP8_OP_SUB;
+		case 0x6:
+			return CHIP8_OP_SHR;
+		case 0x7:
+			return CHIP8_OP_SUBN;
+		case 0xE:
+			return CHIP8_OP_SHL;
+		default:
+			return CHIP8_OP_INVALID;
+		}
+	case 0x9:
+		return CHIP8_OP_SNE;
+	case 0xA:
+		return CHIP8_OP_LD_I;
+	case 0xB:
+		return CHIP8_OP_JP_V0;
+	case 0xC:
+		return CHIP8_OP_RND;
+	case 0xD:
+		return CHIP8_OP_DRW;
+	case 0xE:
+		switch (ins & 0x00FF) {
+		case 0x9E:
+			return CHIP8_OP_SKP;
+		case 0xA1:
+			return CHIP8_OP_SKNP;
+		default:
+			return CHIP8_OP_INVALID;
+		}
+	default:
+		switch (ins & 0x00FF) {
+		case 0x07:
+			return CHIP8_OP_LD_VX_DT;
+		case 0x0A:
+			return CHIP8_OP_LD_VX_K;
+		case 0x15:
+			return CHIP8_OP_LD_DT_VX;
+		case 0x18:
+			return CHIP8_OP_LD_ST_VX;
+		case 0x29:
+			return CHIP8_OP_LD_F_VX;
+		case 0x33:
+			return CHIP8_OP_LD_B_VX;
+		case 0x55:
+			return CHIP8_OP_LD_I_VX;
+		case 0x65:
+			return CHIP8_OP_LD_VX_I;
+		default:
+			return CHIP8_OP_UNKNOWN;
+		}
+	}
+}
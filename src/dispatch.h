@@ -0,0 +1,72 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include "chip8.h"
+
+#define CHIP8_OPCODES 0x10000
+
+/*
+ * Every handler takes the raw instruction and returns 0 to continue, 1 for
+ * EXIT, or a negative value if execution cannot continue
+ */
+typedef int (*chip8_handler)(struct chip8 *chip, unsigned short ins);
+
+enum chip8_op {
+	CHIP8_OP_NOP,
+	CHIP8_OP_CLS,
+	CHIP8_OP_RET,
+	CHIP8_OP_EXIT,
+	CHIP8_OP_JP,
+	CHIP8_OP_CALL,
+	CHIP8_OP_SE_IMM,
+	CHIP8_OP_SNE_IMM,
+	CHIP8_OP_SE,
+	CHIP8_OP_LD_IMM,
+	CHIP8_OP_ADD_IMM,
+	CHIP8_OP_LD,
+	CHIP8_OP_OR,
+	CHIP8_OP_AND,
+	CHIP8_OP_ADD,
+	CHIP8_OP_SUB,
+	CHIP8_OP_SHR,
+	CHIP8_OP_SUBN,
+	CHIP8_OP_SHL,
+	CHIP8_OP_SNE,
+	CHIP8_OP_LD_I,
+	CHIP8_OP_JP_V0,
+	CHIP8_OP_RND,
+	CHIP8_OP_DRW,
+	CHIP8_OP_SKP,
+	CHIP8_OP_SKNP,
+	CHIP8_OP_LD_VX_DT,
+	CHIP8_OP_LD_VX_K,
+	CHIP8_OP_LD_DT_VX,
+	CHIP8_OP_LD_ST_VX,
+	CHIP8_OP_LD_F_VX,
+	CHIP8_OP_LD_B_VX,
+	CHIP8_OP_LD_I_VX,
+	CHIP8_OP_LD_VX_I,
+	CHIP8_OP_UNKNOWN,
+	CHIP8_OP_INVALID,
+	CHIP8_OP_COUNT
+};
+
+extern chip8_handler chip8_dispatch_table[CHIP8_OPCODES];
+extern byte chip8_op_table[CHIP8_OPCODES];
+extern const chip8_handler chip8_op_handlers[CHIP8_OP_COUNT];
+extern const char *chip8_op_names[CHIP8_OP_COUNT];
+
+void chip8_dispatch_init(void);
+enum chip8_op chip8_op_decode(unsigned short ins);
+
+#endif /* DISPATCH_H */
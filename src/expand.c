@@ -0,0 +1,62 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#include "expand.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Turn the packed display into 32-bit pixels, row-major, ready to be
+ * uploaded as a texture
+ */
+void chip8_expand_display(struct chip8 *chip, uint32_t *pixels,
+	uint32_t on, uint32_t off)
+{
+	uint64_t row;
+	int x, y;
+#ifdef __SSE2__
+	/* All-ones lanes for the lit pixels of each 4-pixel nibble */
+	static const uint32_t nibble_masks[16][4] = {
+		{ 0, 0, 0, 0 }, { 0, 0, 0, ~0u },
+		{ 0, 0, ~0u, 0 }, { 0, 0, ~0u, ~0u },
+		{ 0, ~0u, 0, 0 }, { 0, ~0u, 0, ~0u },
+		{ 0, ~0u, ~0u, 0 }, { 0, ~0u, ~0u, ~0u },
+		{ ~0u, 0, 0, 0 }, { ~0u, 0, 0, ~0u },
+		{ ~0u, 0, ~0u, 0 }, { ~0u, 0, ~0u, ~0u },
+		{ ~0u, ~0u, 0, 0 }, { ~0u, ~0u, 0, ~0u },
+		{ ~0u, ~0u, ~0u, 0 }, { ~0u, ~0u, ~0u, ~0u }
+	};
+	const __m128i vdiff = _mm_set1_epi32((int) (on ^ off));
+	const __m128i voff = _mm_set1_epi32((int) off);
+	__m128i set;
+
+	for (y = 0; y < CHIP8_DISPLAYH; y++) {
+		row = chip8_display_row(chip, y);
+		for (x = 0; x < CHIP8_DISPLAYW; x += 4) {
+			set = _mm_loadu_si128((const __m128i *)
+				nibble_masks[row >> 60]);
+			set = _mm_xor_si128(voff, _mm_and_si128(vdiff, set));
+			_mm_storeu_si128((__m128i *) pixels, set);
+			pixels += 4;
+			row <<= 4;
+		}
+	}
+#else
+	for (y = 0; y < CHIP8_DISPLAYH; y++) {
+		row = chip8_display_row(chip, y);
+		for (x = 0; x < CHIP8_DISPLAYW; x++) {
+			*pixels++ = row >> 63 ? on : off;
+			row <<= 1;
+		}
+	}
+#endif
+}
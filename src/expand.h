@@ -0,0 +1,22 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#ifndef EXPAND_H
+#define EXPAND_H
+
+#include <stdint.h>
+#include "chip8.h"
+
+#define CHIP8_PIXELS (CHIP8_DISPLAYW * CHIP8_DISPLAYH)
+
+void chip8_expand_display(struct chip8 *chip, uint32_t *pixels,
+	uint32_t on, uint32_t off);
+
+#endif /* EXPAND_H */
@@ -0,0 +1,133 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#include "fuse.h"
+#include "dispatch.h"
+
+const char *chip8_fusion_names[CHIP8_FUSE_COUNT] = {
+	[CHIP8_FUSE_NONE] = "none",
+	[CHIP8_FUSE_LD_SUB] = "ld+sub",
+	[CHIP8_FUSE_LD_SUB_RET] = "ld+sub+ret",
+	[CHIP8_FUSE_LD_SKP] = "ld+skp",
+	[CHIP8_FUSE_SKIP_CALL] = "skip+call",
+	[CHIP8_FUSE_LD_I_DRW] = "ldi+drw",
+	[CHIP8_FUSE_LD_I_DRW_RET] = "ldi+drw+ret"
+};
+
+static byte op_at(struct chip8 *chip, unsigned int addr)
+{
+	if (addr + 1 >= CHIP8_RAMBYTES) {
+		return CHIP8_OP_INVALID;
+	}
+	return chip8_op_table[chip->ram[addr] << 8 | chip->ram[addr + 1]];
+}
+
+/* Pick the superinstruction, if any, that starts at addr */
+byte chip8_fuse_match(struct chip8 *chip, unsigned short addr)
+{
+	byte first = op_at(chip, addr);
+	byte second = op_at(chip, addr + 2);
+	byte third = op_at(chip, addr + 4);
+
+	switch (first) {
+	case CHIP8_OP_LD_IMM:
+		if (second == CHIP8_OP_SUB) {
+			if (third == CHIP8_OP_RET) {
+				return CHIP8_FUSE_LD_SUB_RET;
+			}
+			return CHIP8_FUSE_LD_SUB;
+		}
+		if (second == CHIP8_OP_SKP || second == CHIP8_OP_SKNP) {
+			return CHIP8_FUSE_LD_SKP;
+		}
+		break;
+	case CHIP8_OP_SE_IMM:
+	case CHIP8_OP_SNE_IMM:
+		if (second == CHIP8_OP_CALL) {
+			return CHIP8_FUSE_SKIP_CALL;
+		}
+		break;
+	case CHIP8_OP_LD_I:
+		if (second == CHIP8_OP_DRW) {
+			if (third == CHIP8_OP_RET) {
+				return CHIP8_FUSE_LD_I_DRW_RET;
+			}
+			return CHIP8_FUSE_LD_I_DRW;
+		}
+		break;
+	}
+	return CHIP8_FUSE_NONE;
+}
+
+/*
+ * Run the sequence headed by d, whose PC has already been fetched past.
+ * Returns the number of instructions retired, or a negative value if one
+ * of them stopped execution.
+ */
+int chip8_exec_fused(struct chip8 *chip, struct chip8_decoded *d)
+{
+	struct chip8_decoded *next;
+	byte *v = chip->reg_v;
+	int taken;
+
+	switch (d->fuse) {
+	case CHIP8_FUSE_LD_SUB:
+	case CHIP8_FUSE_LD_SUB_RET:
+		v[d->x] = d->kk;
+		next = chip8_fetch(chip);
+		v[0xF] = v[next->x] > v[next->y];
+		v[next->x] = v[next->x] - v[next->y];
+		if (d->fuse == CHIP8_FUSE_LD_SUB) {
+			return 2;
+		}
+		next = chip8_fetch(chip);
+		if (next->handler(chip, next->ins) != 0) {
+			return -1;
+		}
+		return 3;
+	case CHIP8_FUSE_LD_SKP:
+		v[d->x] = d->kk;
+		next = chip8_fetch(chip);
+		if (next->handler(chip, next->ins) != 0) {
+			return -1;
+		}
+		return 2;
+	case CHIP8_FUSE_SKIP_CALL:
+		taken = v[d->x] == d->kk;
+		if (d->op == CHIP8_OP_SNE_IMM) {
+			taken = !taken;
+		}
+		if (taken) {
+			chip->pc += 2;
+			return 1;
+		}
+		next = chip8_fetch(chip);
+		if (next->handler(chip, next->ins) != 0) {
+			return -1;
+		}
+		return 2;
+	case CHIP8_FUSE_LD_I_DRW:
+	case CHIP8_FUSE_LD_I_DRW_RET:
+		chip->reg_i = d->nnn;
+		next = chip8_fetch(chip);
+		if (next->handler(chip, next->ins) != 0) {
+			return -1;
+		}
+		if (d->fuse == CHIP8_FUSE_LD_I_DRW) {
+			return 2;
+		}
+		next = chip8_fetch(chip);
+		if (next->handler(chip, next->ins) != 0) {
+			return -1;
+		}
+		return 3;
+	}
+	return d->handler(chip, d->ins) != 0 ? -1 : 1;
+}
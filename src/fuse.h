@@ -0,0 +1,21 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#ifndef FUSE_H
+#define FUSE_H
+
+#include "chip8.h"
+
+extern const char *chip8_fusion_names[CHIP8_FUSE_COUNT];
+
+byte chip8_fuse_match(struct chip8 *chip, unsigned short addr);
+int chip8_exec_fused(struct chip8 *chip, struct chip8_decoded *d);
+
+#endif /* FUSE_H */
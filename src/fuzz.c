@@ -0,0 +1,509 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+/*
+ * chip8-fuzz: coverage-guided fuzzing of one ROM, in process. A test case
+ * is an input script, an RND seed and, with -m, a mutated copy of the
+ * program. Every run restores a snapshot of the loaded machine and steps
+ * the case through chip8_exec_instruction, marking each PC it executes and
+ * each PC-to-PC edge it takes in bitmaps shared by all runs. A case that
+ * marks anything new joins the corpus that later cases are mutated from.
+ *
+ * Faults stop only the run that hit them. The first case to hit each kind
+ * of fault at each address is saved with -o, as an input script that
+ * chip8 -P and chip8-batch replay.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "chip8.h"
+#include "input.h"
+#include "snapshot.h"
+
+#define USAGE_FMT "Usage: %s [-n FRAMES] [-i RUNS] [-t SECONDS] " \
+	"[-r SEED] [-m] [-v] [-o DIR] ROM\n"
+#define PATH_BUFSIZE 1024
+#define DEFAULT_FRAMES 600
+#define DEFAULT_SECONDS 60
+#define STATUS_SECONDS 10
+/* Instructions per frame, the same as chip8 -H and chip8-batch */
+#define FUZZ_IPF 10
+#define MAX_EVENTS 256
+#define MAX_MUTATIONS 4
+/* How far one mutation moves an input event, in frames */
+#define MAX_SHIFT 30
+
+#define BIT_TEST(map, i) ((map)[(i) >> 3] >> ((i) & 0x7) & 0x1)
+#define BIT_SET(map, i) ((map)[(i) >> 3] |= 1 << ((i) & 0x7))
+
+struct testcase {
+	struct chip8_input_event events[MAX_EVENTS];
+	size_t count;
+	uint32_t seed;
+	byte *rom; /* The mutated program, or NULL for the one loaded */
+};
+
+struct fuzzer {
+	struct chip8 *chip;
+	struct chip8_snapshot start;
+	struct chip8_keyboard keyboard;
+	struct chip8_renderer renderer;
+	struct chip8_input input;
+	size_t rom_size;
+	int mutate_rom;
+	byte *rom; /* Where mutate builds the next case's program */
+	unsigned long max_frames;
+	uint32_t rng;
+	const char *outdir;
+
+	struct testcase *corpus;
+	size_t ncorpus;
+	size_t capacity;
+	struct testcase next;
+
+	byte pcs[CHIP8_RAMBYTES / 8];
+	byte *edges; /* Bit from * CHIP8_RAMBYTES + to */
+	byte faults[CHIP8_FAULT_COUNT][CHIP8_RAMBYTES / 8];
+	unsigned long npcs;
+	unsigned long nedges;
+	unsigned long nfaults;
+	unsigned long runs;
+};
+
+static void null_render(struct chip8 *chip)
+{
+	(void) chip;
+}
+
+static void null_check(struct chip8 *chip)
+{
+	(void) chip;
+}
+
+static uint32_t fuzz_rand(struct fuzzer *fz, uint32_t n)
+{
+	fz->rng = chip8_xorshift(fz->rng);
+	return fz->rng % n;
+}
+
+/* Mostly nothing or a single key, which is what games test for */
+static unsigned short random_keys(struct fuzzer *fz)
+{
+	switch (fuzz_rand(fz, 8)) {
+	case 0:
+	case 1:
+		return 0;
+	case 2:
+		return fuzz_rand(fz, 0x10000);
+	default:
+		return 1 << fuzz_rand(fz, 16);
+	}
+}
+
+/* Mark the instruction at from and the edge to to; 1 if either is new */
+static int cover(struct fuzzer *fz, unsigned short from, unsigned short to)
+{
+	size_t edge = (size_t) from * CHIP8_RAMBYTES + to % CHIP8_RAMBYTES;
+	int novel = 0;
+
+	if (!BIT_TEST(fz->pcs, from)) {
+		BIT_SET(fz->pcs, from);
+		fz->npcs++;
+		novel = 1;
+	}
+	if (!BIT_TEST(fz->edges, edge)) {
+		BIT_SET(fz->edges, edge);
+		fz->nedges++;
+		novel = 1;
+	}
+	return novel;
+}
+
+static void save_case(struct fuzzer *fz, struct testcase *tc,
+	const char *name)
+{
+	char path[PATH_BUFSIZE];
+	struct chip8_input input;
+	FILE *fp;
+
+	if (fz->outdir == NULL) {
+		return;
+	}
+	chip8_input_init(&input);
+	input.events = tc->events;
+	input.count = tc->count;
+	snprintf(path, PATH_BUFSIZE, "%s/%s.log", fz->outdir, name);
+	chip8_input_save(&input, path, tc->seed);
+	if (tc->rom == NULL) {
+		return;
+	}
+	snprintf(path, PATH_BUFSIZE, "%s/%s.ch8", fz->outdir, name);
+	fp = fopen(path, "wb");
+	if (!fp || fwrite(tc->rom, 1, fz->rom_size, fp) != fz->rom_size) {
+		printf("Cannot write %s\n", path);
+	}
+	if (fp) {
+		fclose(fp);
+	}
+}
+
+/* Report and save the first case to hit each fault at each address */
+static void check_fault(struct fuzzer *fz, struct testcase *tc)
+{
+	struct chip8 *chip = fz->chip;
+	unsigned short addr = (chip->pc - 2) % CHIP8_RAMBYTES;
+	char name[32];
+
+	if (chip->fault == CHIP8_FAULT_NONE
+		|| BIT_TEST(fz->faults[chip->fault], addr)) {
+		return;
+	}
+	BIT_SET(fz->faults[chip->fault], addr);
+	fz->nfaults++;
+	printf("run %lu: %s at 0x%03X, seed %lu\n", fz->runs,
+		chip8_fault_names[chip->fault], addr,
+		(unsigned long) tc->seed);
+	snprintf(name, sizeof(name), "fault-%03X-%d", addr, chip->fault);
+	save_case(fz, tc, name);
+}
+
+/*
+ * Replay tc the way chip8-batch runs a job: the keys are read at the start
+ * of every frame and the timers tick at its end. Returns 1 if the run
+ * reached anything no run before it had.
+ */
+static int run_case(struct fuzzer *fz, struct testcase *tc)
+{
+	struct chip8 *chip = fz->chip;
+	unsigned long frame;
+	unsigned long end;
+	unsigned short from;
+	int novel = 0;
+	int ret;
+
+	chip8_restore(chip, &fz->start);
+	if (tc->rom != NULL) {
+		memcpy(chip->ram + CHIP8_PROGSTART, tc->rom, fz->rom_size);
+		chip8_icache_invalidate(chip, CHIP8_PROGSTART, fz->rom_size);
+	}
+	chip8_seed(chip, tc->seed);
+	chip8_input_init(&fz->input);
+	fz->input.events = tc->events;
+	fz->input.count = tc->count;
+	for (frame = 0; frame < fz->max_frames; frame++) {
+		chip8_input_frame(&fz->input, frame);
+		end = (frame + 1) * FUZZ_IPF;
+		while (chip->cycles < end) {
+			if (chip->is_halted || chip->pc + 2 >= CHIP8_RAMBYTES) {
+				return novel;
+			}
+			from = chip->pc;
+			ret = chip8_exec_instruction(chip);
+			novel |= cover(fz, from, chip->pc);
+			if (ret < 0) {
+				check_fault(fz, tc);
+				return novel;
+			}
+		}
+		chip8_tick(chip, 1);
+	}
+	return novel;
+}
+
+/* Events stay sorted by frame; a new one goes after those at its frame */
+static void insert_event(struct testcase *tc, unsigned long frame,
+	unsigned short keys)
+{
+	size_t i = tc->count;
+
+	if (tc->count == MAX_EVENTS) {
+		return;
+	}
+	while (i > 0 && tc->events[i - 1].frame > frame) {
+		tc->events[i] = tc->events[i - 1];
+		i--;
+	}
+	tc->events[i].frame = frame;
+	tc->events[i].keys = keys;
+	tc->count++;
+}
+
+static void delete_event(struct testcase *tc, size_t i)
+{
+	memmove(&tc->events[i], &tc->events[i + 1],
+		(tc->count - i - 1) * sizeof(tc->events[0]));
+	tc->count--;
+}
+
+/* Keep next's events before a random frame and take other's from there */
+static void splice(struct fuzzer *fz, struct testcase *next,
+	const struct testcase *other)
+{
+	unsigned long cut = fuzz_rand(fz, fz->max_frames);
+	size_t i;
+
+	while (next->count > 0
+		&& next->events[next->count - 1].frame >= cut) {
+		next->count--;
+	}
+	for (i = 0; i < other->count && next->count < MAX_EVENTS; i++) {
+		if (other->events[i].frame >= cut) {
+			next->events[next->count++] = other->events[i];
+		}
+	}
+}
+
+static void mutate(struct fuzzer *fz, const struct testcase *parent)
+{
+	struct testcase *next = &fz->next;
+	byte *rom = fz->rom;
+	struct chip8_input_event event;
+	long frame;
+	size_t i;
+	int n;
+
+	*next = *parent;
+	next->rom = NULL;
+	if (fz->mutate_rom) {
+		next->rom = rom;
+		if (parent->rom != NULL) {
+			memcpy(rom, parent->rom, fz->rom_size);
+		} else {
+			memcpy(rom, fz->start.ram + CHIP8_PROGSTART,
+				fz->rom_size);
+		}
+	}
+	for (n = 1 + fuzz_rand(fz, MAX_MUTATIONS); n > 0; n--) {
+		i = next->count > 0 ? fuzz_rand(fz, next->count) : 0;
+		switch (fuzz_rand(fz, fz->mutate_rom ? 8 : 6)) {
+		case 0:
+			insert_event(next, fuzz_rand(fz, fz->max_frames),
+				random_keys(fz));
+			break;
+		case 1:
+			if (next->count > 0) {
+				delete_event(next, i);
+			}
+			break;
+		case 2:
+			if (next->count > 0) {
+				next->events[i].keys ^= 1 << fuzz_rand(fz, 16);
+			}
+			break;
+		case 3:
+			if (next->count > 0) {
+				event = next->events[i];
+				delete_event(next, i);
+				frame = (long) event.frame - MAX_SHIFT
+					+ fuzz_rand(fz, 2 * MAX_SHIFT + 1);
+				insert_event(next, frame < 0 ? 0 : frame,
+					event.keys);
+			}
+			break;
+		case 4:
+			splice(fz, next, &fz->corpus[fuzz_rand(fz,
+				fz->ncorpus)]);
+			break;
+		case 5:
+			next->seed = fuzz_rand(fz, 0xFFFFFFFF) + 1;
+			break;
+		case 6:
+			rom[fuzz_rand(fz, fz->rom_size)] ^=
+				1 << fuzz_rand(fz, 8);
+			break;
+		case 7:
+			rom[fuzz_rand(fz, fz->rom_size)] = fuzz_rand(fz, 256);
+			break;
+		}
+	}
+}
+
+static int add_case(struct fuzzer *fz, struct testcase *tc)
+{
+	struct testcase *corpus;
+	struct testcase *copy;
+	size_t capacity;
+	char name[32];
+
+	if (fz->ncorpus == fz->capacity) {
+		capacity = fz->capacity ? fz->capacity * 2 : 64;
+		corpus = realloc(fz->corpus, capacity * sizeof(*corpus));
+		if (corpus == NULL) {
+			return -1;
+		}
+		fz->corpus = corpus;
+		fz->capacity = capacity;
+	}
+	copy = &fz->corpus[fz->ncorpus];
+	*copy = *tc;
+	if (tc->rom != NULL) {
+		copy->rom = malloc(fz->rom_size);
+		if (copy->rom == NULL) {
+			return -1;
+		}
+		memcpy(copy->rom, tc->rom, fz->rom_size);
+	}
+	snprintf(name, sizeof(name), "queue-%06lu",
+		(unsigned long) fz->ncorpus);
+	save_case(fz, copy, name);
+	fz->ncorpus++;
+	return 0;
+}
+
+static void print_status(struct fuzzer *fz, double elapsed)
+{
+	printf("%lu runs, %.0f runs/s, %lu PCs, %lu edges, %lu in corpus, "
+		"%lu faults\n", fz->runs,
+		elapsed > 0 ? fz->runs / elapsed : 0.0, fz->npcs, fz->nedges,
+		(unsigned long) fz->ncorpus, fz->nfaults);
+	fflush(stdout);
+}
+
+static unsigned long parse_count(const char *arg)
+{
+	char *end;
+	unsigned long count = strtoul(arg, &end, 10);
+	if (*arg == '\0' || *end != '\0' || count == 0) {
+		fprintf(stderr, "Not a positive count: %s\n", arg);
+		exit(EXIT_FAILURE);
+	}
+	return count;
+}
+
+int main(int argc, char *argv[])
+{
+	struct fuzzer fz;
+	struct stat st;
+	unsigned long max_runs = 0;
+	unsigned long seconds = DEFAULT_SECONDS;
+	uint32_t seed = 1;
+	int verbose = 0;
+	time_t start;
+	time_t now;
+	time_t last_status;
+	extern char *optarg;
+	extern int optind;
+	int opt;
+
+	memset(&fz, 0, sizeof(fz));
+	fz.max_frames = DEFAULT_FRAMES;
+	while ((opt = getopt(argc, argv, "n:i:t:r:mvo:")) > 0) {
+		switch (opt) {
+		case 'n':
+			fz.max_frames = parse_count(optarg);
+			break;
+		case 'i':
+			max_runs = parse_count(optarg);
+			break;
+		case 't':
+			seconds = parse_count(optarg);
+			break;
+		case 'r':
+			seed = parse_count(optarg);
+			break;
+		case 'm':
+			fz.mutate_rom = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'o':
+			fz.outdir = optarg;
+			break;
+		default:
+			fprintf(stderr, USAGE_FMT, argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, USAGE_FMT, argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if (fz.outdir && mkdir(fz.outdir, 0777) < 0 && access(fz.outdir,
+		W_OK) < 0) {
+		perror(fz.outdir);
+		exit(EXIT_FAILURE);
+	}
+
+	fz.chip = malloc(sizeof(*fz.chip));
+	fz.edges = calloc(CHIP8_RAMBYTES / 8, CHIP8_RAMBYTES);
+	if (fz.chip == NULL || fz.edges == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	fz.renderer.data = NULL;
+	fz.renderer.render_display = null_render;
+	chip8_input_init(&fz.input);
+	chip8_input_keyboard(&fz.input, &fz.keyboard);
+	chip8_init(fz.chip, &fz.keyboard, &fz.renderer, null_check);
+	/* Coverage is per instruction, so nothing may run fused */
+	fz.chip->fusion_enabled = 0;
+	if (chip8_load(fz.chip, argv[optind]) < 0) {
+		exit(EXIT_FAILURE);
+	}
+	if (stat(argv[optind], &st) < 0) {
+		perror(argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	fz.chip->pc = CHIP8_PROGSTART;
+	chip8_snapshot(fz.chip, &fz.start);
+	fz.rom_size = st.st_size;
+	if (fz.rom_size == 0) {
+		fz.mutate_rom = 0;
+	}
+	if (fz.mutate_rom) {
+		fz.rom = malloc(fz.rom_size);
+		if (fz.rom == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	fz.rng = seed;
+	/* Unrecognized instructions are reported on stderr every time */
+	if (!verbose && freopen("/dev/null", "w", stderr) == NULL) {
+		printf("Cannot silence stderr\n");
+	}
+
+	start = time(NULL);
+	last_status = start;
+	fz.next.count = 0;
+	fz.next.seed = seed;
+	fz.next.rom = NULL;
+	run_case(&fz, &fz.next);
+	fz.runs++;
+	if (add_case(&fz, &fz.next) < 0) {
+		printf("Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	while (max_runs == 0 || fz.runs < max_runs) {
+		if (fz.runs % 256 == 0) {
+			now = time(NULL);
+			if ((unsigned long) (now - start) >= seconds) {
+				break;
+			}
+			if (now - last_status >= STATUS_SECONDS) {
+				print_status(&fz, difftime(now, start));
+				last_status = now;
+			}
+		}
+		mutate(&fz, &fz.corpus[fuzz_rand(&fz, fz.ncorpus)]);
+		if (run_case(&fz, &fz.next) && add_case(&fz, &fz.next) < 0) {
+			printf("Out of memory\n");
+			break;
+		}
+		fz.runs++;
+	}
+	print_status(&fz, difftime(time(NULL), start));
+	return fz.nfaults > 0 ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#include "headless.h"
+
+static void null_render(struct chip8 *chip)
+{
+	(void) chip;
+}
+
+/* Nobody is there to press a key, so LD Vx, K reads key 0 */
+static byte null_waitkey(struct chip8 *chip)
+{
+	(void) chip;
+	return 0x0;
+}
+
+static int null_is_key_down(struct chip8 *chip, byte keyval)
+{
+	(void) chip;
+	(void) keyval;
+	return 0;
+}
+
+void chip8_headless_setup(struct chip8_headless *headless,
+	struct chip8_renderer *renderer, struct chip8_keyboard *keyboard)
+{
+	headless->frames = 0;
+	if (headless->ipf == 0) {
+		headless->ipf = CHIP8_HEADLESS_IPF;
+	}
+	renderer->data = headless;
+	renderer->render_display = null_render;
+	if (headless->input != NULL) {
+		chip8_input_keyboard(headless->input, keyboard);
+		chip8_input_frame(headless->input, 0);
+		return;
+	}
+	keyboard->data = NULL;
+	keyboard->waitkey = null_waitkey;
+	keyboard->is_key_down = null_is_key_down;
+}
+
+/*
+ * Stands in for both the kill check and the timer thread: every ipf
+ * instructions is one frame, which ticks the timers and counts toward the
+ * frame limit. Nothing changes before the next frame or the cycle limit,
+ * so wait loops may be skipped up to whichever comes first.
+ */
+void chip8_headless_check(struct chip8 *chip)
+{
+	struct chip8_headless *headless = chip->renderer->data;
+	unsigned long frames = chip->cycles / headless->ipf;
+
+	if (headless->frames < frames) {
+		chip8_tick(chip, frames - headless->frames);
+	}
+	while (headless->frames < frames) {
+		headless->frames++;
+		chip->frame_pending = 1;
+		if (headless->input != NULL) {
+			chip8_input_frame(headless->input, headless->frames);
+		}
+	}
+	if ((headless->max_cycles && chip->cycles >= headless->max_cycles)
+		|| (headless->max_frames
+			&& headless->frames >= headless->max_frames)) {
+		chip8_halt(chip);
+	}
+	chip->idle_until = (headless->frames + 1) * headless->ipf;
+	if (headless->max_cycles && headless->max_cycles < chip->idle_until) {
+		chip->idle_until = headless->max_cycles;
+	}
+}
+
+void chip8_headless_report(struct chip8 *chip, FILE *fp, double elapsed)
+{
+	struct chip8_headless *headless = chip->renderer->data;
+	int i;
+
+	fprintf(fp, "PC %03X  I %03X  SP %X  DT %02X  ST %02X\n",
+		chip->pc, chip->reg_i, chip->sp, chip8_getdt(chip),
+		chip8_getst(chip));
+	for (i = 0; i < CHIP8_REGCOUNT; i++) {
+		fprintf(fp, "V%X %02X%c", i, chip->reg_v[i],
+			i % 8 == 7 ? '\n' : ' ');
+	}
+	for (i = 0; i < CHIP8_DISPLAYH; i++) {
+		fprintf(fp, "%016llX\n",
+			(unsigned long long) chip8_display_row(chip, i));
+	}
+	fprintf(fp, "State hash %016llX\n",
+		(unsigned long long) chip8_hash(chip));
+	fprintf(fp, "%lu instructions, %lu frames in %.3f s (%.0f ins/s)\n",
+		chip->cycles, headless->frames, elapsed,
+		elapsed > 0 ? chip->cycles / elapsed : 0.0);
+}
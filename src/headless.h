@@ -0,0 +1,38 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include <stdio.h>
+#include "chip8.h"
+#include "input.h"
+
+/* Instructions per virtual 60 Hz frame when there is no real clock */
+#define CHIP8_HEADLESS_IPF 10
+
+/*
+ * A run with no display or wall clock, and either no keyboard or a replayed
+ * input log; 0 means no limit
+ */
+struct chip8_headless {
+	struct chip8_input *input;
+	unsigned long max_cycles;
+	unsigned long max_frames;
+	unsigned long frames;
+	unsigned int ipf;
+};
+
+void chip8_headless_setup(struct chip8_headless *headless,
+	struct chip8_renderer *renderer, struct chip8_keyboard *keyboard);
+void chip8_headless_check(struct chip8 *chip);
+void chip8_headless_report(struct chip8 *chip, FILE *fp, double elapsed);
+
+#endif /* HEADLESS_H */
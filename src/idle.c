@@ -0,0 +1,146 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+/*
+ * Wait loops: a JP to itself, a loop reading DT until it reaches a value,
+ * and a loop on SKP or SKNP until a key changes. Nothing such a loop does
+ * can change what it sees next time round; only the timers and the keys
+ * can, and those change only when whoever keeps the machine's time says
+ * so. That is chip->idle_until, the cycle count of the next timer tick or
+ * input frame, when time is counted in instructions: every whole pass of
+ * the loop that ends by then is skipped, leaving the machine exactly as
+ * running them would have. In real time, chip->idle instead waits for the
+ * next frame, rather than spinning until it comes.
+ *
+ * LD Vx, K that finds no key stays where it is and runs again, so it is a
+ * loop of one instruction while chip->key_wait says the last try failed.
+ */
+
+#include "idle.h"
+#include "dispatch.h"
+#include <stddef.h>
+
+/* Instructions in one pass of each loop */
+static const unsigned int idle_len[CHIP8_IDLE_COUNT] = {
+	[CHIP8_IDLE_NONE] = 0,
+	[CHIP8_IDLE_JP] = 1,
+	[CHIP8_IDLE_DT_SE] = 3,
+	[CHIP8_IDLE_DT_SNE] = 3,
+	[CHIP8_IDLE_SKP] = 2,
+	[CHIP8_IDLE_SKNP] = 2,
+	[CHIP8_IDLE_KEY] = 1
+};
+
+static unsigned short ins_at(struct chip8 *chip, unsigned int addr)
+{
+	if (addr + 1 >= CHIP8_RAMBYTES) {
+		return 0x0000;
+	}
+	return chip->ram[addr] << 8 | chip->ram[addr + 1];
+}
+
+/* Pick the wait loop, if any, that starts at addr */
+byte chip8_idle_match(struct chip8 *chip, unsigned short addr)
+{
+	unsigned short first = ins_at(chip, addr);
+	unsigned short second = ins_at(chip, addr + 2);
+	unsigned short third = ins_at(chip, addr + 4);
+	unsigned short x = first & 0x0F00;
+	unsigned short back = 0x1000 | addr;
+
+	if (first == back) {
+		return CHIP8_IDLE_JP;
+	}
+	switch (chip8_op_table[first]) {
+	case CHIP8_OP_LD_VX_DT:
+		if (third != back || (second & 0x0F00) != x) {
+			break;
+		}
+		if (chip8_op_table[second] == CHIP8_OP_SE_IMM) {
+			return CHIP8_IDLE_DT_SE;
+		}
+		if (chip8_op_table[second] == CHIP8_OP_SNE_IMM) {
+			return CHIP8_IDLE_DT_SNE;
+		}
+		break;
+	case CHIP8_OP_SKP:
+		if (second == back) {
+			return CHIP8_IDLE_SKP;
+		}
+		break;
+	case CHIP8_OP_SKNP:
+		if (second == back) {
+			return CHIP8_IDLE_SKNP;
+		}
+		break;
+	case CHIP8_OP_LD_VX_K:
+		return CHIP8_IDLE_KEY;
+	}
+	return CHIP8_IDLE_NONE;
+}
+
+/* Whether the loop headed by d goes round again as things stand */
+static int spinning(struct chip8 *chip, struct chip8_decoded *d)
+{
+	/* After LD Vx, DT, the SE or SNE compares with the byte at PC + 3 */
+	switch (d->idle) {
+	case CHIP8_IDLE_JP:
+		return 1;
+	case CHIP8_IDLE_DT_SE:
+		return chip8_getdt(chip) != chip->ram[chip->pc + 3];
+	case CHIP8_IDLE_DT_SNE:
+		return chip8_getdt(chip) == chip->ram[chip->pc + 3];
+	case CHIP8_IDLE_SKP:
+		return !chip->keyboard->is_key_down(chip, chip->reg_v[d->x]);
+	case CHIP8_IDLE_SKNP:
+		return chip->keyboard->is_key_down(chip, chip->reg_v[d->x]);
+	case CHIP8_IDLE_KEY:
+		return chip->key_wait;
+	}
+	return 0;
+}
+
+/*
+ * Called with PC at the loop headed by d, before running it. Returns 1 if
+ * the loop was skipped ahead, counting the instructions it would have run,
+ * or waited on, and 0 to run the head instruction as usual.
+ */
+int chip8_idle(struct chip8 *chip, struct chip8_decoded *d)
+{
+	unsigned long len = idle_len[d->idle];
+	unsigned long passes = 0;
+
+	if (chip->is_halted || !spinning(chip, d)) {
+		return 0;
+	}
+	if (d->idle == CHIP8_IDLE_KEY) {
+		/* Skipped to the next frame or waited for it: ask again */
+		chip->key_wait = 0;
+	}
+	if (chip->idle_until > chip->cycles) {
+		passes = (chip->idle_until - chip->cycles) / len;
+	}
+	if (passes > 0) {
+		if (d->idle == CHIP8_IDLE_DT_SE
+			|| d->idle == CHIP8_IDLE_DT_SNE) {
+			chip->reg_v[d->x] = chip8_getdt(chip);
+		}
+		chip->cycles += passes * len;
+		chip->idle_cycles += passes * len;
+		return 1;
+	}
+	if (chip->idle != NULL) {
+		/* Whatever it does to the machine, the caller fetches anew */
+		chip->idle_waits++;
+		chip->idle(chip);
+		return 1;
+	}
+	return 0;
+}
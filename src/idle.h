@@ -0,0 +1,19 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#ifndef IDLE_H
+#define IDLE_H
+
+#include "chip8.h"
+
+byte chip8_idle_match(struct chip8 *chip, unsigned short addr);
+int chip8_idle(struct chip8 *chip, struct chip8_decoded *d);
+
+#endif /* IDLE_H */
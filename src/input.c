@@ -0,0 +1,197 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#include "input.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LINE_BUFSIZE 128
+#define SEED_HEADER "# chip8 input log, seed %lu\n"
+
+void chip8_input_init(struct chip8_input *input)
+{
+	input->events = NULL;
+	input->count = 0;
+	input->capacity = 0;
+	input->next = 0;
+	input->frame = 0;
+	input->keys = 0;
+	input->seed = 0;
+	input->has_seed = 0;
+}
+
+static int append_event(struct chip8_input *input, unsigned long frame,
+	unsigned short keys)
+{
+	struct chip8_input_event *events;
+	size_t capacity;
+	if (input->count == input->capacity) {
+		capacity = input->capacity ? input->capacity * 2 : 16;
+		events = realloc(input->events, capacity * sizeof(*events));
+		if (events == NULL) {
+			return -1;
+		}
+		input->events = events;
+		input->capacity = capacity;
+	}
+	input->events[input->count].frame = frame;
+	input->events[input->count].keys = keys;
+	input->count++;
+	return 0;
+}
+
+/*
+ * An input script has one "FRAME KEYS" pair per line, frames ascending and
+ * KEYS a hexadecimal mask with bit k set while key k is down. Lines
+ * starting with '#' are comments, except that a first line written by
+ * chip8_input_save gives the RND seed the log was recorded with.
+ */
+int chip8_input_load(struct chip8_input *input, const char *file_name)
+{
+	char line[LINE_BUFSIZE];
+	unsigned long frame;
+	unsigned int keys;
+	unsigned long seed;
+	unsigned long lineno = 0;
+	FILE *fp = fopen(file_name, "r");
+	if (!fp) {
+		perror(file_name);
+		return -1;
+	}
+	chip8_input_init(input);
+	while (fgets(line, LINE_BUFSIZE, fp) != NULL) {
+		lineno++;
+		if (lineno == 1 && sscanf(line, SEED_HEADER, &seed) == 1) {
+			input->seed = seed;
+			input->has_seed = 1;
+			continue;
+		}
+		if (line[0] == '#' || line[0] == '\n') {
+			continue;
+		}
+		if (sscanf(line, "%lu %x", &frame, &keys) != 2 || keys > 0xFFFF
+			|| (input->count > 0
+			&& frame < input->events[input->count - 1].frame)) {
+			fprintf(stderr, "%s:%lu: Bad input event\n", file_name,
+				lineno);
+			fclose(fp);
+			chip8_input_free(input);
+			return -1;
+		}
+		if (append_event(input, frame, keys) < 0) {
+			perror("realloc");
+			fclose(fp);
+			chip8_input_free(input);
+			return -1;
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+/* Write the events back out in the format chip8_input_load reads */
+int chip8_input_save(struct chip8_input *input, const char *file_name,
+	uint32_t seed)
+{
+	size_t i;
+	FILE *fp = fopen(file_name, "w");
+	if (!fp) {
+		perror(file_name);
+		return -1;
+	}
+	fprintf(fp, SEED_HEADER, (unsigned long) seed);
+	for (i = 0; i < input->count; i++) {
+		fprintf(fp, "%lu %X\n", input->events[i].frame,
+			input->events[i].keys);
+	}
+	if (fclose(fp) != 0) {
+		perror(file_name);
+		return -1;
+	}
+	return 0;
+}
+
+void chip8_input_free(struct chip8_input *input)
+{
+	free(input->events);
+	chip8_input_init(input);
+}
+
+/*
+ * Apply every event due before frame and the first one due at it; any
+ * others at the same frame are left for LD Vx, K to pick up
+ */
+void chip8_input_frame(struct chip8_input *input, unsigned long frame)
+{
+	struct chip8_input_event *event;
+	input->frame = frame;
+	while (input->next < input->count) {
+		event = &input->events[input->next];
+		if (event->frame > frame) {
+			break;
+		}
+		input->keys = event->keys;
+		input->next++;
+		if (event->frame == frame) {
+			break;
+		}
+	}
+}
+
+/* Log the keys sampled at the start of frame, if they changed */
+int chip8_input_record(struct chip8_input *input, unsigned long frame,
+	unsigned short keys)
+{
+	input->frame = frame;
+	input->keys = keys;
+	if (input->count > 0 && input->events[input->count - 1].keys == keys) {
+		return 0;
+	}
+	return append_event(input, frame, keys);
+}
+
+static int input_is_key_down(struct chip8 *chip, byte keyval)
+{
+	struct chip8_input *input = chip->keyboard->data;
+	return keyval <= 0xF && (input->keys >> keyval & 0x1);
+}
+
+/*
+ * A wait takes the next event logged for this frame if there is one, then
+ * reads the lowest key down. With none down it waits for a later frame of
+ * the script; once the script has run out, it reads key 0 instead.
+ */
+byte chip8_input_waitkey(struct chip8_input *input)
+{
+	byte key;
+	if (input->next < input->count
+		&& input->events[input->next].frame == input->frame) {
+		input->keys = input->events[input->next].keys;
+		input->next++;
+	}
+	key = chip8_lowest_key(input->keys);
+	if (key == CHIP8_KEY_NONE && input->next == input->count) {
+		return 0x0;
+	}
+	return key;
+}
+
+static byte input_waitkey(struct chip8 *chip)
+{
+	return chip8_input_waitkey(chip->keyboard->data);
+}
+
+void chip8_input_keyboard(struct chip8_input *input,
+	struct chip8_keyboard *keyboard)
+{
+	keyboard->data = input;
+	keyboard->waitkey = input_waitkey;
+	keyboard->is_key_down = input_is_key_down;
+}
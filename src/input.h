@@ -0,0 +1,51 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stddef.h>
+#include "chip8.h"
+
+/*
+ * From frame on, the keys whose bits are set in keys are held down. A
+ * second event for the same frame is left for an LD Vx, K wait during that
+ * frame to take.
+ */
+struct chip8_input_event {
+	unsigned long frame;
+	unsigned short keys;
+};
+
+/* A scripted keyboard, recorded or replayed one frame at a time */
+struct chip8_input {
+	struct chip8_input_event *events;
+	size_t count;
+	size_t capacity;
+	size_t next;
+	unsigned long frame;
+	unsigned short keys;
+	uint32_t seed; /* RND seed named in the log's first line */
+	int has_seed;
+};
+
+void chip8_input_init(struct chip8_input *input);
+int chip8_input_load(struct chip8_input *input, const char *file_name);
+int chip8_input_save(struct chip8_input *input, const char *file_name,
+	uint32_t seed);
+void chip8_input_free(struct chip8_input *input);
+void chip8_input_frame(struct chip8_input *input, unsigned long frame);
+int chip8_input_record(struct chip8_input *input, unsigned long frame,
+	unsigned short keys);
+byte chip8_input_waitkey(struct chip8_input *input);
+void chip8_input_keyboard(struct chip8_input *input,
+	struct chip8_keyboard *keyboard);
+
+#endif /* INPUT_H */
@@ -11,12 +11,45 @@
 #include "instructions.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "chip8.h"
 
+/* 0000 - NOP */
+int chip8_nop(struct chip8 *chip, unsigned short ins)
+{
+	(void) chip;
+	(void) ins;
+	return 0;
+}
+
+/* 00FD - EXIT */
+int chip8_exit(struct chip8 *chip, unsigned short ins)
+{
+	(void) chip;
+	(void) ins;
+	return 1;
+}
+
+/* Unrecognized instructions are reported and skipped */
+int chip8_unknown(struct chip8 *chip, unsigned short ins)
+{
+	(void) chip;
+	fprintf(stderr, "Unrecognized instruction: 0x%04X\n", ins);
+	return 0;
+}
+
+/* Malformed instructions in the 8xyn and Exkk groups fault */
+int chip8_invalid(struct chip8 *chip, unsigned short ins)
+{
+	(void) ins;
+	return chip8_fault(chip, CHIP8_FAULT_BAD_INSTRUCTION);
+}
+
+/* Return addresses are kept in stack[1] to stack[CHIP8_STACKSIZE - 1] */
 static int chip8_pushpc(struct chip8 *chip)
 {
-	if (chip->sp + 1 > CHIP8_STACKSIZE) {
-		return 1;
+	if (chip->sp + 1 >= CHIP8_STACKSIZE) {
+		return chip8_fault(chip, CHIP8_FAULT_STACK);
 	}
 	chip->sp++;
 	chip->stack[chip->sp] = chip->pc;
@@ -25,40 +58,44 @@ static int chip8_pushpc(struct chip8 *chip)
 
 static int chip8_poppc(struct chip8 *chip)
 {
-	if (chip->sp - 1 < 0) {
-		return 1;
+	if (chip->sp == 0) {
+		return chip8_fault(chip, CHIP8_FAULT_STACK);
 	}
 	chip->pc = chip->stack[chip->sp];
 	chip->sp--;
 	return 0;
 }
 
-void chip8_ret(struct chip8 *chip)
+int chip8_ret(struct chip8 *chip, unsigned short ins)
 {
-	chip8_poppc(chip);
+	(void) ins;
+	return chip8_poppc(chip);
 }
 
-void chip8_call(struct chip8 *chip, unsigned short ins)
+int chip8_call(struct chip8 *chip, unsigned short ins)
 {
 	unsigned short addr;
 
 	/* CALL addr */
 	addr = ins & 0x0FFF;
-	chip8_pushpc(chip);
+	if (chip8_pushpc(chip) != 0) {
+		return -1;
+	}
 	chip->pc = addr;
+	return 0;
 }
 
-void chip8_jump(struct chip8 *chip, unsigned short ins)
+int chip8_jump(struct chip8 *chip, unsigned short ins)
 {
 	unsigned short addr;
 
 	/* JP addr */
 	addr = ins & 0x0FFF;
 	if (addr > CHIP8_RAMBYTES) {
-		fprintf(stderr, "Invalid jump\n");
-		abort();
+		return chip8_fault(chip, CHIP8_FAULT_BAD_JUMP);
 	}
 	chip->pc = addr;
+	return 0;
 }
 
 static void skip_next(struct chip8 *chip)
@@ -67,7 +104,7 @@ static void skip_next(struct chip8 *chip)
 }
 
 /* 3xkk - skip next instruction if Vx = kk */
-void chip8_se_immediate(struct chip8 *chip, unsigned short ins)
+int chip8_se_immediate(struct chip8 *chip, unsigned short ins)
 {
 	byte x, y;
 	byte regval;
@@ -79,10 +116,11 @@ void chip8_se_immediate(struct chip8 *chip, unsigned short ins)
 	if (regval == y) {
 		skip_next(chip);
 	}
+	return 0;
 }
 
 /* 4xkk - Skip next instruction if Vx == kk */
-void chip8_sne_immediate(struct chip8 *chip, unsigned short ins)
+int chip8_sne_immediate(struct chip8 *chip, unsigned short ins)
 {
 	byte x = (ins & 0x0F00) >> 8;
 	byte kk = ins & 0x00FF;
@@ -90,36 +128,40 @@ void chip8_sne_immediate(struct chip8 *chip, unsigned short ins)
 	if (regval != kk) {
 		skip_next(chip);
 	}
+	return 0;
 }
 
 /* 9xy0 - Skip next instruction if Vx == Vy */
-void chip8_sne(struct chip8 *chip, unsigned short ins)
+int chip8_sne(struct chip8 *chip, unsigned short ins)
 {
 	byte x = (ins & 0x0F00) >> 8;
 	byte y = (ins & 0x00F0) >> 4;
 	if (chip->reg_v[x] != chip->reg_v[y]) {
 		skip_next(chip);
 	}
+	return 0;
 }
 
-void chip8_se(struct chip8 *chip, unsigned short ins)
+int chip8_se(struct chip8 *chip, unsigned short ins)
 {
 	byte x = (ins & 0x0F00) >> 8;
 	byte y = (ins & 0x00F0) >> 4;
 	if (chip->reg_v[x] == chip->reg_v[y]) {
 		skip_next(chip);
 	}
+	return 0;
 }
 
-void chip8_load_i(struct chip8 *chip, unsigned short ins)
+int chip8_load_i(struct chip8 *chip, unsigned short ins)
 {
 	unsigned short addr;
 	/* LD I, addr */
 	addr = ins & 0x0FFF;
 	chip->reg_i = addr;
+	return 0;
 }
 
-void chip8_load_immediate(struct chip8 *chip, unsigned short ins)
+int chip8_load_immediate(struct chip8 *chip, unsigned short ins)
 {
 	byte x, y;
 
@@ -127,6 +169,7 @@ void chip8_load_immediate(struct chip8 *chip, unsigned short ins)
 	x = (ins & 0x0F00) >> 8;
 	y = ins & 0x00FF;
 	chip8_setv(chip, x, y);
+	return 0;
 }
 
 static void print_sprite(byte *sprite, int n)
@@ -146,71 +189,50 @@ static void print_sprite(byte *sprite, int n)
 	}
 }
 
-static int is_within_display(int x, int y)
-{
-	return x >= 0 && y >= 0 && x < CHIP8_DISPLAYW && y < CHIP8_DISPLAYH;
-}
-
 /* DRW Vx, Vy, byte */
-void chip8_draw(struct chip8 *chip, unsigned short ins)
+int chip8_draw(struct chip8 *chip, unsigned short ins)
 {
 	byte x, y;
 	byte n; /* Sprite length */
 	unsigned short addr;
 	byte vx, vy;
-	byte sprite[CHIP8_SPRITEBYTES];
-	int i, j;
-	int bit;
-	int oldbit;
-	int currbit;
-	int disp_x, disp_y;
-	byte collision;
+	int i;
+	uint64_t row;
+	uint64_t collision;
 
 	x = (ins & 0x0F00) >> 8;
 	y = (ins & 0x00F0) >> 4;
 	n = ins & 0x000F;
 	if (n > CHIP8_SPRITEBYTES) {
-		fprintf(stderr, "Invalid sprite length: 0x%04X\n", ins);
-		exit(EXIT_FAILURE);
+		return chip8_fault(chip, CHIP8_FAULT_BAD_SPRITE);
 	}
 
+	/* The whole sprite has to be in RAM */
 	addr = chip->reg_i;
-	if (addr >= CHIP8_RAMBYTES) {
-		fprintf(stderr, "Invalid draw address: 0x%04X\n", addr);
-		abort();
+	if (addr >= CHIP8_RAMBYTES || addr + n > CHIP8_RAMBYTES) {
+		return chip8_fault(chip, CHIP8_FAULT_BAD_DRAW);
 	}
 
 	vx = chip->reg_v[x];
 	vy = chip->reg_v[y];
 
-	for (i = 0; i < n; i++) {
-		sprite[i] = chip->ram[addr + i];
-	}
-	/* print_sprite(sprite, n); */ /* DEBUG */
+	/* print_sprite(&chip->ram[addr], n); */ /* DEBUG */
 
-	oldbit = 0x0;
-	currbit = 0x0;
-	collision = 0x0;
-	for (i = 0; i < n; i++) {
-		for (j = 7; j >= 0; j--) {
-			disp_x = vx + (7 - j);
-			disp_y = vy + i;
-			if (!is_within_display(disp_x, disp_y)) {
-				continue;
-			}
-			bit = BIT(sprite[i], j);
-			oldbit = chip8_getpixel(chip, disp_x, disp_y);
-			currbit = bit ^ oldbit;
-			chip8_setpixel(chip, disp_x, disp_y, currbit);
-			if (collision == 0x0) {
-				collision = oldbit == 0x1 && currbit == 0x0;
-			}
+	/* Sprites are clipped, not wrapped, at the right and bottom edges */
+	collision = 0;
+	if (vx < CHIP8_DISPLAYW) {
+		for (i = 0; i < n && vy + i < CHIP8_DISPLAYH; i++) {
+			row = (uint64_t) chip->ram[addr + i] << 56 >> vx;
+			collision |= chip->display[vy + i] & row;
+			chip->display[vy + i] ^= row;
 		}
 	}
-	chip8_setvf(chip, collision);
+	chip8_setvf(chip, collision != 0);
+	chip->display_dirty = 1;
+	return 0;
 }
 
-void chip8_add_immediate(struct chip8 *chip, unsigned short ins)
+int chip8_add_immediate(struct chip8 *chip, unsigned short ins)
 {
 	byte x, y;
 
@@ -218,9 +240,10 @@ void chip8_add_immediate(struct chip8 *chip, unsigned short ins)
 	x = (ins & 0x0F00) >> 8;
 	y = ins & 0x00FF;
 	chip8_setv(chip, x, chip->reg_v[x] + y);
+	return 0;
 }
 
-void chip8_add(struct chip8 *chip, unsigned short ins)
+int chip8_add(struct chip8 *chip, unsigned short ins)
 {
 	byte x, y;
 	unsigned int result;
@@ -236,9 +259,10 @@ void chip8_add(struct chip8 *chip, unsigned short ins)
 		chip8_setvf(chip, 0x0);
 	}
 	chip8_setv(chip, x, result & 0xFF);
+	return 0;
 }
 
-void chip8_sub(struct chip8 *chip, unsigned short ins)
+int chip8_sub(struct chip8 *chip, unsigned short ins)
 {
 	byte x = (ins & 0x0F00) >> 8;
 	byte y = (ins & 0x00F0) >> 4;
@@ -248,58 +272,69 @@ void chip8_sub(struct chip8 *chip, unsigned short ins)
 		chip8_setvf(chip, 0x0);
 	}
 	chip8_setv(chip, x, chip->reg_v[x] - chip->reg_v[y]);
+	return 0;
 }
 
-void chip8_cls(struct chip8 *chip)
+int chip8_cls(struct chip8 *chip, unsigned short ins)
 {
-	int i, j;
-	for (i = 0; i < CHIP8_DISPLAYH; i++) {
-		for (j = 0; j < CHIP8_DISPLAYW; j++) {
-			chip8_setpixel(chip, j, i, 0x0);
-		}
-	}
+	(void) ins;
+	memset(chip->display, 0, sizeof(chip->display));
+	chip->display_dirty = 1;
+	return 0;
 }
 
-void chip8_ld(struct chip8 *chip, unsigned short ins)
+int chip8_ld(struct chip8 *chip, unsigned short ins)
 {
 	byte x = (ins & 0x0F00) >> 8;
 	byte y = (ins & 0x00F0) >> 4;
 	chip8_setv(chip, x, chip->reg_v[y]);
+	return 0;
 }
 
-void chip8_waitkey(struct chip8 *chip, unsigned short ins)
+int chip8_waitkey(struct chip8 *chip, unsigned short ins)
 {
 	byte x;
 	byte keycode;
 
 	/* LD Vx, K */
 	x = (ins & 0x0F00) >> 8;
-	keycode = chip->keyboard->waitkey();
+	keycode = chip->keyboard->waitkey(chip);
+	if (keycode > 0xF) {
+		/* No key yet: stay on this instruction and ask again */
+		chip->pc -= 2;
+		chip->key_wait = 1;
+		return 0;
+	}
+	chip->key_wait = 0;
 	chip8_setv(chip, x, keycode);
+	return 0;
 }
 
-void chip8_load_from_dt(struct chip8* chip, unsigned short ins)
+int chip8_load_from_dt(struct chip8* chip, unsigned short ins)
 {
 	/* LD Vx, DT */
 	byte x = (ins & 0x0F00) >> 8;
-	chip8_setv(chip, x, chip->reg_dt);
+	chip8_setv(chip, x, chip8_getdt(chip));
+	return 0;
 }
 
-void chip8_load_dt(struct chip8 *chip, unsigned short ins)
+int chip8_load_dt(struct chip8 *chip, unsigned short ins)
 {
 	/* LD DT, Vx */
 	byte x = (ins & 0x0F00) >> 8;
-	chip->reg_dt = chip->reg_v[x];
+	chip8_setdt(chip, chip->reg_v[x]);
+	return 0;
 }
 
-void chip8_load_st(struct chip8 *chip, unsigned short ins)
+int chip8_load_st(struct chip8 *chip, unsigned short ins)
 {
 	/* LD ST, Vx */
 	byte x = (ins & 0x0F00) >> 8;
-	chip->reg_st = chip->reg_v[x];
+	chip8_setst(chip, chip->reg_v[x]);
+	return 0;
 }
 
-void chip8_load_range_from_i(struct chip8 *chip, unsigned short ins)
+int chip8_load_range_from_i(struct chip8 *chip, unsigned short ins)
 {
 	byte x = (ins & 0x0F00) >> 8;
 	int i;
@@ -312,15 +347,15 @@ void chip8_load_range_from_i(struct chip8 *chip, unsigned short ins)
 	/* LD Vx, [I] */
 	for (i = 0; i <= x; i++) {
 		addr = chip->reg_i + i;
-		if (addr > CHIP8_RAMBYTES || addr < CHIP8_PROGSTART) {
-			fprintf(stderr, "Invalid memory access\n");
-			abort();
+		if (addr >= CHIP8_RAMBYTES || addr < CHIP8_PROGSTART) {
+			return chip8_fault(chip, CHIP8_FAULT_BAD_READ);
 		}
 		chip8_setv(chip, i, chip->ram[addr]);
 	}
+	return 0;
 }
 
-void chip8_store_bcd(struct chip8 *chip, unsigned short ins)
+int chip8_store_bcd(struct chip8 *chip, unsigned short ins)
 {
 	byte x = (ins & 0x0F00) >> 8;
 	byte val = chip->reg_v[x];
@@ -330,16 +365,17 @@ void chip8_store_bcd(struct chip8 *chip, unsigned short ins)
 	byte ones = val - hundreds * 100 - tens * 10;
 
 	if (addr + 2 >= CHIP8_RAMBYTES) {
-		fprintf(stderr, "RAM overflow\n");
-		abort();
+		return chip8_fault(chip, CHIP8_FAULT_BAD_WRITE);
 	}
 
 	chip->ram[addr] = hundreds;
 	chip->ram[addr + 1] = tens;
 	chip->ram[addr + 2] = ones;
+	chip8_icache_invalidate(chip, addr, 3);
+	return 0;
 }
 
-void chip8_load_i_hexfont(struct chip8 *chip, unsigned short ins)
+int chip8_load_i_hexfont(struct chip8 *chip, unsigned short ins)
 {
 	byte x;
 	byte val;
@@ -350,50 +386,56 @@ void chip8_load_i_hexfont(struct chip8 *chip, unsigned short ins)
 	if (val <= 0xF) {
 		chip->reg_i = CHIP8_FONTSTART + val * CHIP8_FONTWIDTH;
 	}
+	return 0;
 }
 
-void chip8_rnd(struct chip8 *chip, unsigned short ins)
+int chip8_rnd(struct chip8 *chip, unsigned short ins)
 {
 	/* RND Vx, byte */
 	byte x = (ins & 0x0F00) >> 8;
 	byte b = ins & 0x00FF;
-	byte r = rand();
+	byte r = chip8_random(chip);
 	chip8_setv(chip, x, r & b);
+	return 0;
 }
 
-void chip8_or(struct chip8 *chip, unsigned short ins)
+int chip8_or(struct chip8 *chip, unsigned short ins)
 {
 	byte x = (ins & 0x0F00) >> 8;
 	byte y = (ins & 0x00F0) >> 4;
 	chip8_setv(chip, x, chip->reg_v[x] | chip->reg_v[y]);
+	return 0;
 }
 
-void chip8_and(struct chip8 *chip, unsigned short ins)
+int chip8_and(struct chip8 *chip, unsigned short ins)
 {
 	byte x = (ins & 0x0F00) >> 8;
 	byte y = (ins & 0x00F0) >> 4;
 	chip8_setv(chip, x, chip->reg_v[x] & chip->reg_v[y]);
+	return 0;
 }
 
-void chip8_skp(struct chip8 *chip, unsigned short ins)
+int chip8_skp(struct chip8 *chip, unsigned short ins)
 {
 	byte x = (ins & 0x0F00) >> 8;
 	byte keycode = chip->reg_v[x];
-	if (chip->keyboard->is_key_down(keycode)) {
+	if (chip->keyboard->is_key_down(chip, keycode)) {
 		skip_next(chip);
 	}
+	return 0;
 }
 
-void chip8_sknp(struct chip8 *chip, unsigned short ins)
+int chip8_sknp(struct chip8 *chip, unsigned short ins)
 {
 	byte x = (ins & 0x0F00) >> 8;
 	byte keycode = chip->reg_v[x];
-	if (!chip->keyboard->is_key_down(keycode)) {
+	if (!chip->keyboard->is_key_down(chip, keycode)) {
 		skip_next(chip);
 	}
+	return 0;
 }
 
-void chip8_shr(struct chip8 *chip, unsigned short ins)
+int chip8_shr(struct chip8 *chip, unsigned short ins)
 {
 	byte x = (ins & 0x0F00) >> 8;
 	if ((chip->reg_v[x] & 0x1) == 0x1) {
@@ -402,9 +444,10 @@ void chip8_shr(struct chip8 *chip, unsigned short ins)
 		chip8_setvf(chip, 0x0);
 	}
 	chip8_setv(chip, x, chip->reg_v[x] >> 1);
+	return 0;
 }
 
-void chip8_subn(struct chip8 *chip, unsigned short ins)
+int chip8_subn(struct chip8 *chip, unsigned short ins)
 {
 	byte x = (ins & 0x0F00) >> 8;
 	byte y = (ins & 0x00F0) >> 4;
@@ -414,9 +457,10 @@ void chip8_subn(struct chip8 *chip, unsigned short ins)
 		chip8_setvf(chip, 0x0);
 	}
 	chip8_setv(chip, x, chip->reg_v[y] - chip->reg_v[x]);
+	return 0;
 }
 
-void chip8_shl(struct chip8 *chip, unsigned short ins)
+int chip8_shl(struct chip8 *chip, unsigned short ins)
 {
 	byte x = (ins & 0x0F00) >> 8;
 	if ((chip->reg_v[x] & 0x1) == 0x1) {
@@ -425,20 +469,21 @@ void chip8_shl(struct chip8 *chip, unsigned short ins)
 		chip8_setvf(chip, 0x0);
 	}
 	chip8_setv(chip, x, chip->reg_v[x] << 1);
+	return 0;
 }
 
-void chip8_jump_add(struct chip8 *chip, unsigned short ins)
+int chip8_jump_add(struct chip8 *chip, unsigned short ins)
 {
 	unsigned short addr = ins & 0x0FFF;
 	unsigned short result_addr = addr + chip->reg_v[0];
 	if (result_addr > CHIP8_RAMBYTES || result_addr < CHIP8_PROGSTART) {
-		fprintf(stderr, "Invalid memory access\n");
-		abort();
+		return chip8_fault(chip, CHIP8_FAULT_BAD_JUMP);
 	}
 	chip->pc = result_addr;
+	return 0;
 }
 
-void chip8_store_range_from_i(struct chip8 *chip, unsigned short ins)
+int chip8_store_range_from_i(struct chip8 *chip, unsigned short ins)
 {
 	byte x = (ins & 0x0F00) >> 8;
 	int i;
@@ -450,10 +495,12 @@ void chip8_store_range_from_i(struct chip8 *chip, unsigned short ins)
 
 	for (i = 0; i <= x; i++) {
 		addr = chip->reg_i + i;
-		if (addr > CHIP8_RAMBYTES || addr < CHIP8_PROGSTART) {
-			fprintf(stderr, "Memory access error\n");
-			abort();
+		if (addr >= CHIP8_RAMBYTES || addr < CHIP8_PROGSTART) {
+			chip8_icache_invalidate(chip, chip->reg_i, i);
+			return chip8_fault(chip, CHIP8_FAULT_BAD_WRITE);
 		}
 		chip->ram[addr] = chip->reg_v[i];
 	}
+	chip8_icache_invalidate(chip, chip->reg_i, x + 1);
+	return 0;
 }
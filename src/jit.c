@@ -0,0 +1,768 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+/*
+ * Basic-block JIT for x86-64. A block runs until the first JP, CALL, RET,
+ * skip or memory store and is translated straight into native code. Register
+ * and ALU instructions are compiled inline, with guest V registers kept in
+ * r8-r15 for the lifetime of a block; everything else (DRW, keys, timers,
+ * RND, ...) is a call into the regular handler. Blocks with a known successor
+ * are chained with a direct jump, patched in the first time the exit is
+ * taken. A store that overwrites translated code flushes the whole code
+ * cache.
+ *
+ * Register use inside generated code: rbx points at the struct chip8, ebp
+ * counts the blocks left in the current slice, eax/ecx/edx are scratch.
+ */
+
+#include "jit.h"
+#include "dispatch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+
+#define JIT_CODESIZE (1024 * 1024)
+#define JIT_BLOCK_RESERVE 8192
+#define JIT_MAX_BLOCK 64
+#define JIT_MAX_LINKS 8192
+#define JIT_CHAIN_SLICE 256
+#define JIT_HOSTREGS 8
+
+#define OFF_V(v) ((int) (offsetof(struct chip8, reg_v) + (v)))
+#define OFF_I ((int) offsetof(struct chip8, reg_i))
+#define OFF_PC ((int) offsetof(struct chip8, pc))
+#define OFF_CYCLES ((int) offsetof(struct chip8, cycles))
+#define OFF_IDLE_UNTIL ((int) offsetof(struct chip8, idle_until))
+
+enum jit_exit {
+	JIT_EXIT_HALT,
+	JIT_EXIT_DYNAMIC,
+	JIT_EXIT_WRITE,
+	JIT_EXIT_STEP,
+	JIT_EXIT_LINK
+};
+
+enum x86_reg {
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+enum x86_cond {
+	CC_B = 0x2,
+	CC_E = 0x4,
+	CC_NE = 0x5
+};
+
+struct jit_link {
+	byte *site;
+	unsigned short target;
+};
+
+struct jit_vreg {
+	int host;
+	int loaded;
+	int dirty;
+};
+
+struct chip8_jit {
+	byte *code;
+	byte *cursor;
+	byte *epilogue;
+	byte *exit_dynamic;
+	byte *exit_halt;
+	byte *exit_write;
+	byte *exit_step;
+	byte *blocks_start;
+	int (*enter)(struct chip8 *chip, byte *code, int budget);
+	byte *blocks[CHIP8_RAMBYTES];
+	byte code_map[CHIP8_RAMBYTES];
+	struct jit_link links[JIT_MAX_LINKS];
+	int num_links;
+	unsigned long generation;
+	struct jit_vreg vregs[CHIP8_REGCOUNT];
+	int next_host;
+};
+
+static void emit8(struct chip8_jit *jit, byte b)
+{
+	*jit->cursor++ = b;
+}
+
+static void emit32(struct chip8_jit *jit, uint32_t v)
+{
+	memcpy(jit->cursor, &v, 4);
+	jit->cursor += 4;
+}
+
+static void emit64(struct chip8_jit *jit, uint64_t v)
+{
+	memcpy(jit->cursor, &v, 8);
+	jit->cursor += 8;
+}
+
+static void emit_rex(struct chip8_jit *jit, int w, int r, int b)
+{
+	byte rex = 0x40 | (w << 3) | ((r >= R8) << 2) | (b >= R8);
+	if (rex != 0x40) {
+		emit8(jit, rex);
+	}
+}
+
+/* ModRM for [rbx + disp32] with the given reg field */
+static void emit_mem(struct chip8_jit *jit, int reg, int disp)
+{
+	emit8(jit, 0x80 | (reg & 7) << 3 | RBX);
+	emit32(jit, disp);
+}
+
+static void patch_rel32(byte *site, byte *target)
+{
+	int32_t rel = target - (site + 4);
+	memcpy(site, &rel, 4);
+}
+
+static byte *emit_jmp(struct chip8_jit *jit, byte *target)
+{
+	byte *site;
+	emit8(jit, 0xE9);
+	site = jit->cursor;
+	emit32(jit, 0);
+	patch_rel32(site, target);
+	return site;
+}
+
+static byte *emit_jcc(struct chip8_jit *jit, enum x86_cond cc, byte *target)
+{
+	byte *site;
+	emit8(jit, 0x0F);
+	emit8(jit, 0x80 | cc);
+	site = jit->cursor;
+	emit32(jit, 0);
+	patch_rel32(site, target);
+	return site;
+}
+
+/* mov dst32, src32 */
+static void emit_mov(struct chip8_jit *jit, int dst, int src)
+{
+	emit_rex(jit, 0, src, dst);
+	emit8(jit, 0x89);
+	emit8(jit, 0xC0 | (src & 7) << 3 | (dst & 7));
+}
+
+/* mov dst32, imm32 */
+static void emit_mov_imm(struct chip8_jit *jit, int dst, uint32_t imm)
+{
+	emit_rex(jit, 0, 0, dst);
+	emit8(jit, 0xB8 + (dst & 7));
+	emit32(jit, imm);
+}
+
+/* movzx dst32, byte [rbx + disp] */
+static void emit_load_byte(struct chip8_jit *jit, int dst, int disp)
+{
+	emit_rex(jit, 0, dst, 0);
+	emit8(jit, 0x0F);
+	emit8(jit, 0xB6);
+	emit_mem(jit, dst, disp);
+}
+
+/* mov byte [rbx + disp], src8 */
+static void emit_store_byte(struct chip8_jit *jit, int disp, int src)
+{
+	emit_rex(jit, 0, src, 0);
+	emit8(jit, 0x88);
+	emit_mem(jit, src, disp);
+}
+
+static void emit_set_pc(struct chip8_jit *jit, unsigned short pc)
+{
+	/* mov word [rbx + pc], imm16 */
+	emit8(jit, 0x66);
+	emit8(jit, 0xC7);
+	emit_mem(jit, 0, OFF_PC);
+	emit8(jit, pc & 0xFF);
+	emit8(jit, pc >> 8);
+}
+
+static void emit_cycles(struct chip8_jit *jit, int n)
+{
+	if (n > 0) {
+		/* add qword [rbx + cycles], imm32 */
+		emit_rex(jit, 1, 0, 0);
+		emit8(jit, 0x81);
+		emit_mem(jit, 0, OFF_CYCLES);
+		emit32(jit, n);
+	}
+}
+
+static void reset_vregs(struct chip8_jit *jit)
+{
+	int i;
+	for (i = 0; i < CHIP8_REGCOUNT; i++) {
+		jit->vregs[i].host = -1;
+		jit->vregs[i].loaded = 0;
+		jit->vregs[i].dirty = 0;
+	}
+	jit->next_host = R8;
+}
+
+/* Write back every V register modified in a host register */
+static void flush_vregs(struct chip8_jit *jit)
+{
+	int i;
+	for (i = 0; i < CHIP8_REGCOUNT; i++) {
+		if (jit->vregs[i].dirty) {
+			emit_store_byte(jit, OFF_V(i), jit->vregs[i].host);
+			jit->vregs[i].dirty = 0;
+		}
+	}
+}
+
+/* Host registers are stale once a handler may have changed reg_v */
+static void forget_vregs(struct chip8_jit *jit)
+{
+	int i;
+	for (i = 0; i < CHIP8_REGCOUNT; i++) {
+		jit->vregs[i].loaded = 0;
+	}
+}
+
+static struct jit_vreg *vreg(struct chip8_jit *jit, byte v)
+{
+	struct jit_vreg *r = &jit->vregs[v];
+	if (r->host < 0 && jit->next_host < R8 + JIT_HOSTREGS) {
+		r->host = jit->next_host++;
+	}
+	return r;
+}
+
+static void load_v(struct chip8_jit *jit, int dst, byte v)
+{
+	struct jit_vreg *r = vreg(jit, v);
+	if (r->host < 0) {
+		emit_load_byte(jit, dst, OFF_V(v));
+		return;
+	}
+	if (!r->loaded) {
+		emit_load_byte(jit, r->host, OFF_V(v));
+		r->loaded = 1;
+	}
+	emit_mov(jit, dst, r->host);
+}
+
+/* The value in src must already be in the range 0-255 */
+static void store_v(struct chip8_jit *jit, byte v, int src)
+{
+	struct jit_vreg *r = vreg(jit, v);
+	if (r->host < 0) {
+		emit_store_byte(jit, OFF_V(v), src);
+		return;
+	}
+	emit_mov(jit, r->host, src);
+	r->loaded = 1;
+	r->dirty = 1;
+}
+
+/* and eax, 0xFF */
+static void emit_mask_eax(struct chip8_jit *jit)
+{
+	emit8(jit, 0x25);
+	emit32(jit, 0xFF);
+}
+
+/* seta dl; movzx edx, dl */
+static void emit_seta_edx(struct chip8_jit *jit)
+{
+	emit8(jit, 0x0F);
+	emit8(jit, 0x97);
+	emit8(jit, 0xC2);
+	emit8(jit, 0x0F);
+	emit8(jit, 0xB6);
+	emit8(jit, 0xD2);
+}
+
+static void emit_alu(struct chip8_jit *jit, byte opcode)
+{
+	/* op eax, ecx */
+	emit8(jit, opcode);
+	emit8(jit, 0xC8);
+}
+
+/*
+ * Step out of the block unless all of it fits before chip->idle_until,
+ * so that the timers tick at the same instruction as in the interpreter.
+ * With no frame boundary idle_until is 0 and the difference wraps around.
+ * Returns the site of the block length, known once the block is done.
+ */
+static byte *emit_entry_check(struct chip8_jit *jit)
+{
+	byte *site;
+
+	/* mov rax, [rbx + idle_until]; sub rax, [rbx + cycles] */
+	emit_rex(jit, 1, 0, 0);
+	emit8(jit, 0x8B);
+	emit_mem(jit, RAX, OFF_IDLE_UNTIL);
+	emit_rex(jit, 1, 0, 0);
+	emit8(jit, 0x2B);
+	emit_mem(jit, RAX, OFF_CYCLES);
+	/* cmp rax, imm32; jb exit_step */
+	emit_rex(jit, 1, 0, 0);
+	emit8(jit, 0x3D);
+	site = jit->cursor;
+	emit32(jit, 0);
+	emit_jcc(jit, CC_B, jit->exit_step);
+	return site;
+}
+
+/* Leave the block for a known target, chaining to it when possible */
+static void emit_static_exit(struct chip8_jit *jit, int n,
+	unsigned short target)
+{
+	struct jit_link *link;
+
+	emit_set_pc(jit, target);
+	emit_cycles(jit, n);
+	/* sub ebp, 1; jz exit_dynamic */
+	emit8(jit, 0x83);
+	emit8(jit, 0xED);
+	emit8(jit, 0x01);
+	emit_jcc(jit, CC_E, jit->exit_dynamic);
+	if (jit->blocks[target] != NULL) {
+		emit_jmp(jit, jit->blocks[target]);
+	} else if (jit->num_links < JIT_MAX_LINKS) {
+		link = &jit->links[jit->num_links];
+		link->site = emit_jmp(jit, jit->cursor + 5);
+		link->target = target;
+		emit_mov_imm(jit, RAX, JIT_EXIT_LINK + jit->num_links);
+		emit_jmp(jit, jit->epilogue);
+		jit->num_links++;
+	} else {
+		emit_jmp(jit, jit->exit_dynamic);
+	}
+}
+
+static void emit_exit(struct chip8_jit *jit, int n, byte *stub)
+{
+	emit_cycles(jit, n);
+	emit_jmp(jit, stub);
+}
+
+/* Run the instruction through its interpreter handler */
+static void emit_call(struct chip8_jit *jit, struct chip8_decoded *d,
+	unsigned short addr, int n)
+{
+	byte *skip;
+
+	flush_vregs(jit);
+	emit_set_pc(jit, addr + 2);
+	/* mov rdi, rbx */
+	emit8(jit, 0x48);
+	emit8(jit, 0x89);
+	emit8(jit, 0xDF);
+	emit_mov_imm(jit, RSI, d->ins);
+	/* mov rax, imm64; call rax */
+	emit8(jit, 0x48);
+	emit8(jit, 0xB8);
+	emit64(jit, (uint64_t) (uintptr_t) chip8_dispatch_table[d->ins]);
+	emit8(jit, 0xFF);
+	emit8(jit, 0xD0);
+	forget_vregs(jit);
+	/* test eax, eax; jz over the halt exit */
+	emit8(jit, 0x85);
+	emit8(jit, 0xC0);
+	emit8(jit, 0x74);
+	skip = jit->cursor;
+	emit8(jit, 0);
+	emit_exit(jit, n, jit->exit_halt);
+	*skip = jit->cursor - (skip + 1);
+}
+
+static void emit_skip(struct chip8_jit *jit, struct chip8_decoded *d,
+	unsigned short addr, int n)
+{
+	byte *noskip;
+	enum x86_cond cond;
+
+	load_v(jit, RAX, d->x);
+	if (d->op == CHIP8_OP_SE || d->op == CHIP8_OP_SNE) {
+		load_v(jit, RCX, d->y);
+	}
+	flush_vregs(jit);
+	if (d->op == CHIP8_OP_SE || d->op == CHIP8_OP_SNE) {
+		/* cmp eax, ecx */
+		emit_alu(jit, 0x39);
+	} else {
+		/* cmp eax, imm32 */
+		emit8(jit, 0x3D);
+		emit32(jit, d->kk);
+	}
+	if (d->op == CHIP8_OP_SE || d->op == CHIP8_OP_SE_IMM) {
+		cond = CC_NE;
+	} else {
+		cond = CC_E;
+	}
+	noskip = emit_jcc(jit, cond, jit->cursor);
+	emit_static_exit(jit, n + 1, addr + 4);
+	patch_rel32(noskip, jit->cursor);
+	emit_static_exit(jit, n + 1, addr + 2);
+}
+
+/* Compile the straight-line ALU instructions; returns 0 if not one */
+static int emit_native(struct chip8_jit *jit, struct chip8_decoded *d)
+{
+	switch (d->op) {
+	case CHIP8_OP_NOP:
+		break;
+	case CHIP8_OP_LD_IMM:
+		emit_mov_imm(jit, RAX, d->kk);
+		store_v(jit, d->x, RAX);
+		break;
+	case CHIP8_OP_ADD_IMM:
+		load_v(jit, RAX, d->x);
+		emit8(jit, 0x05);
+		emit32(jit, d->kk);
+		emit_mask_eax(jit);
+		store_v(jit, d->x, RAX);
+		break;
+	case CHIP8_OP_LD:
+		load_v(jit, RAX, d->y);
+		store_v(jit, d->x, RAX);
+		break;
+	case CHIP8_OP_OR:
+	case CHIP8_OP_AND:
+		load_v(jit, RAX, d->x);
+		load_v(jit, RCX, d->y);
+		emit_alu(jit, d->op == CHIP8_OP_OR ? 0x09 : 0x21);
+		store_v(jit, d->x, RAX);
+		break;
+	case CHIP8_OP_ADD:
+		load_v(jit, RAX, d->x);
+		load_v(jit, RCX, d->y);
+		emit_alu(jit, 0x01);
+		/* cmp eax, 0xFF */
+		emit8(jit, 0x3D);
+		emit32(jit, 0xFF);
+		emit_seta_edx(jit);
+		store_v(jit, 0xF, RDX);
+		emit_mask_eax(jit);
+		store_v(jit, d->x, RAX);
+		break;
+	case CHIP8_OP_SUB:
+	case CHIP8_OP_SUBN:
+		/* VF is written first, then the operands are read again */
+		if (d->op == CHIP8_OP_SUB) {
+			load_v(jit, RAX, d->x);
+			load_v(jit, RCX, d->y);
+		} else {
+			load_v(jit, RAX, d->y);
+			load_v(jit, RCX, d->x);
+		}
+		emit_alu(jit, 0x39);
+		emit_seta_edx(jit);
+		store_v(jit, 0xF, RDX);
+		if (d->op == CHIP8_OP_SUB) {
+			load_v(jit, RAX, d->x);
+			load_v(jit, RCX, d->y);
+		} else {
+			load_v(jit, RAX, d->y);
+			load_v(jit, RCX, d->x);
+		}
+		emit_alu(jit, 0x29);
+		emit_mask_eax(jit);
+		store_v(jit, d->x, RAX);
+		break;
+	case CHIP8_OP_SHR:
+	case CHIP8_OP_SHL:
+		load_v(jit, RAX, d->x);
+		/* mov edx, eax; and edx, 1 */
+		emit8(jit, 0x89);
+		emit8(jit, 0xC2);
+		emit8(jit, 0x83);
+		emit8(jit, 0xE2);
+		emit8(jit, 0x01);
+		store_v(jit, 0xF, RDX);
+		load_v(jit, RAX, d->x);
+		/* shr eax, 1 / shl eax, 1 */
+		emit8(jit, 0xD1);
+		emit8(jit, d->op == CHIP8_OP_SHR ? 0xE8 : 0xE0);
+		emit_mask_eax(jit);
+		store_v(jit, d->x, RAX);
+		break;
+	case CHIP8_OP_LD_I:
+		/* mov dword [rbx + reg_i], imm32 */
+		emit8(jit, 0xC7);
+		emit_mem(jit, 0, OFF_I);
+		emit32(jit, d->nnn);
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+static void mark_code(struct chip8_jit *jit, unsigned short addr)
+{
+	jit->code_map[addr] = 1;
+	jit->code_map[addr + 1] = 1;
+}
+
+static void flush_blocks(struct chip8_jit *jit)
+{
+	memset(jit->blocks, 0, sizeof(jit->blocks));
+	memset(jit->code_map, 0, sizeof(jit->code_map));
+	jit->num_links = 0;
+	jit->cursor = jit->blocks_start;
+	jit->generation++;
+}
+
+/* Compile the block at start; returns the most instructions it retires */
+static int emit_block(struct chip8_jit *jit, struct chip8 *chip,
+	unsigned short start)
+{
+	unsigned short addr = start;
+	struct chip8_decoded *d;
+	int n = 0;
+
+	reset_vregs(jit);
+	for (;;) {
+		if (addr + 2 >= CHIP8_RAMBYTES || n == JIT_MAX_BLOCK) {
+			flush_vregs(jit);
+			emit_static_exit(jit, n, addr);
+			return n;
+		}
+		mark_code(jit, addr);
+		d = chip8_decoded_at(chip, addr);
+		if (emit_native(jit, d)) {
+			n++;
+			addr += 2;
+			continue;
+		}
+		switch (d->op) {
+		case CHIP8_OP_JP:
+			flush_vregs(jit);
+			emit_static_exit(jit, n + 1, d->nnn);
+			return n + 1;
+		case CHIP8_OP_SE_IMM:
+		case CHIP8_OP_SNE_IMM:
+		case CHIP8_OP_SE:
+		case CHIP8_OP_SNE:
+			emit_skip(jit, d, addr, n);
+			return n + 1;
+		case CHIP8_OP_CALL:
+			emit_call(jit, d, addr, n);
+			emit_static_exit(jit, n + 1, d->nnn);
+			return n + 1;
+		case CHIP8_OP_RET:
+		case CHIP8_OP_JP_V0:
+		case CHIP8_OP_SKP:
+		case CHIP8_OP_SKNP:
+		case CHIP8_OP_LD_VX_K:
+			emit_call(jit, d, addr, n);
+			emit_exit(jit, n + 1, jit->exit_dynamic);
+			return n + 1;
+		case CHIP8_OP_LD_B_VX:
+		case CHIP8_OP_LD_I_VX:
+			emit_call(jit, d, addr, n);
+			emit_exit(jit, n + 1, jit->exit_write);
+			return n + 1;
+		default:
+			emit_call(jit, d, addr, n);
+			n++;
+			addr += 2;
+			break;
+		}
+	}
+}
+
+static byte *translate(struct chip8_jit *jit, struct chip8 *chip,
+	unsigned short start)
+{
+	byte *entry;
+	byte *length;
+	uint32_t n;
+
+	if (jit->code + JIT_CODESIZE - jit->cursor < JIT_BLOCK_RESERVE) {
+		flush_blocks(jit);
+	}
+	entry = jit->cursor;
+	jit->blocks[start] = entry;
+	length = emit_entry_check(jit);
+	n = emit_block(jit, chip, start);
+	memcpy(length, &n, 4);
+	return entry;
+}
+
+static byte *block_for(struct chip8_jit *jit, struct chip8 *chip,
+	unsigned short pc)
+{
+	if (jit->blocks[pc] != NULL) {
+		return jit->blocks[pc];
+	}
+	return translate(jit, chip, pc);
+}
+
+/* A store to [I] landed; drop all code if it overwrote a translated byte */
+static void invalidate(struct chip8_jit *jit, unsigned int addr,
+	unsigned int len)
+{
+	unsigned int i;
+	for (i = addr; i < addr + len && i < CHIP8_RAMBYTES; i++) {
+		if (jit->code_map[i]) {
+			flush_blocks(jit);
+			return;
+		}
+	}
+}
+
+static void emit_stub(struct chip8_jit *jit, enum jit_exit code)
+{
+	emit_mov_imm(jit, RAX, code);
+	emit_jmp(jit, jit->epilogue);
+}
+
+static void emit_trampoline(struct chip8_jit *jit)
+{
+	static const byte prologue[] = {
+		0x53,			/* push rbx */
+		0x55,			/* push rbp */
+		0x41, 0x54,		/* push r12 */
+		0x41, 0x55,		/* push r13 */
+		0x41, 0x56,		/* push r14 */
+		0x41, 0x57,		/* push r15 */
+		0x48, 0x83, 0xEC, 0x08,	/* sub rsp, 8 */
+		0x48, 0x89, 0xFB,	/* mov rbx, rdi */
+		0x89, 0xD5,		/* mov ebp, edx */
+		0xFF, 0xE6		/* jmp rsi */
+	};
+	static const byte epilogue[] = {
+		0x48, 0x83, 0xC4, 0x08,	/* add rsp, 8 */
+		0x41, 0x5F,		/* pop r15 */
+		0x41, 0x5E,		/* pop r14 */
+		0x41, 0x5D,		/* pop r13 */
+		0x41, 0x5C,		/* pop r12 */
+		0x5D,			/* pop rbp */
+		0x5B,			/* pop rbx */
+		0xC3			/* ret */
+	};
+
+	jit->enter = (int (*)(struct chip8 *, byte *, int)) jit->cursor;
+	memcpy(jit->cursor, prologue, sizeof(prologue));
+	jit->cursor += sizeof(prologue);
+	jit->epilogue = jit->cursor;
+	memcpy(jit->cursor, epilogue, sizeof(epilogue));
+	jit->cursor += sizeof(epilogue);
+	jit->exit_halt = jit->cursor;
+	emit_stub(jit, JIT_EXIT_HALT);
+	jit->exit_dynamic = jit->cursor;
+	emit_stub(jit, JIT_EXIT_DYNAMIC);
+	jit->exit_write = jit->cursor;
+	emit_stub(jit, JIT_EXIT_WRITE);
+	jit->exit_step = jit->cursor;
+	emit_stub(jit, JIT_EXIT_STEP);
+	jit->blocks_start = jit->cursor;
+}
+
+static struct chip8_jit *jit_new(void)
+{
+	struct chip8_jit *jit = calloc(1, sizeof(struct chip8_jit));
+	if (jit == NULL) {
+		return NULL;
+	}
+	jit->code = mmap(NULL, JIT_CODESIZE,
+		PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->code == MAP_FAILED) {
+		free(jit);
+		return NULL;
+	}
+	jit->cursor = jit->code;
+	emit_trampoline(jit);
+	return jit;
+}
+
+static void jit_free(struct chip8_jit *jit)
+{
+	munmap(jit->code, JIT_CODESIZE);
+	free(jit);
+}
+
+/* Close to a frame boundary: run one instruction in the interpreter */
+static int jit_step(struct chip8_jit *jit, struct chip8 *chip)
+{
+	struct chip8_decoded *d = chip8_decoded_at(chip, chip->pc);
+	int writes = d->op == CHIP8_OP_LD_B_VX || d->op == CHIP8_OP_LD_I_VX;
+
+	if (chip8_exec_instruction(chip) < 0) {
+		return -1;
+	}
+	if (writes) {
+		invalidate(jit, chip->reg_i, CHIP8_REGCOUNT);
+	}
+	return 0;
+}
+
+void chip8_exec_jit(struct chip8 *chip)
+{
+	struct chip8_jit *jit = jit_new();
+	struct jit_link *link;
+	unsigned long generation;
+	byte *code;
+	int ret;
+
+	if (jit == NULL) {
+		perror("JIT code buffer");
+		chip8_interpret(chip);
+		return;
+	}
+	while (chip->pc + 2 < CHIP8_RAMBYTES && !chip->is_halted) {
+		code = block_for(jit, chip, chip->pc);
+		ret = jit->enter(chip, code, JIT_CHAIN_SLICE);
+		if (ret == JIT_EXIT_HALT) {
+			break;
+		} else if (ret == JIT_EXIT_WRITE) {
+			/* Fx33 and Fx55 write at most 16 bytes from I */
+			invalidate(jit, chip->reg_i, CHIP8_REGCOUNT);
+		} else if (ret >= JIT_EXIT_LINK
+			&& chip->pc + 2 < CHIP8_RAMBYTES) {
+			link = &jit->links[ret - JIT_EXIT_LINK];
+			generation = jit->generation;
+			code = block_for(jit, chip, link->target);
+			if (generation == jit->generation) {
+				patch_rel32(link->site, code);
+			}
+		}
+		if (chip->frame_pending) {
+			chip8_present(chip);
+		}
+		chip->check_kill(chip);
+		if (ret == JIT_EXIT_STEP && !chip->is_halted
+			&& jit_step(jit, chip) < 0) {
+			break;
+		}
+	}
+	chip8_halt(chip);
+	jit_free(jit);
+}
+
+#else /* __x86_64__ && __unix__ */
+
+void chip8_exec_jit(struct chip8 *chip)
+{
+	chip8_interpret(chip);
+}
+
+#endif /* __x86_64__ && __unix__ */
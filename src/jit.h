@@ -0,0 +1,18 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#ifndef JIT_H
+#define JIT_H
+
+#include "chip8.h"
+
+void chip8_exec_jit(struct chip8 *chip);
+
+#endif /* JIT_H */
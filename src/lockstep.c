@@ -0,0 +1,757 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+/*
+ * Lockstep engine: many copies of one ROM, e.g. the same game under
+ * different inputs or seeds, tend to sit at the same PC. Each step picks
+ * the lanes at one PC holding the same instruction there, 16 lanes per
+ * compare, and executes them as a group: register ops, skips and jumps on
+ * SSE2 vectors, everything else lane by lane with the same semantics as the
+ * handlers in instructions.c. Anything that would fault is handed to the
+ * real handler on a scalar copy of the lane, so faults are exactly those of
+ * the scalar engine.
+ */
+
+#include "lockstep.h"
+#include <stdlib.h>
+#include <string.h>
+#include "dispatch.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Every lane array starts on its own cache line */
+#define LANE_BLOCK 64
+/*
+ * Groups are built with a pass over all lanes; past this many in one step,
+ * what is left has diverged and is cheaper to run one lane at a time
+ */
+#define MAX_GROUPS 16
+
+#define V(ls, r, lane) ((ls)->reg_v[r][lane])
+#define RAM(ls, addr, lane) ((ls)->ram[(size_t) (addr) * (ls)->stride \
+	+ (lane)])
+
+static byte *carve(byte *base, size_t *offset, size_t bytes)
+{
+	byte *p = base ? base + *offset : NULL;
+	*offset += (bytes + LANE_BLOCK - 1) / LANE_BLOCK * LANE_BLOCK;
+	return p;
+}
+
+/* Point every lane array into base; returns the bytes needed */
+static size_t lockstep_layout(struct chip8_lockstep *ls, byte *base)
+{
+	size_t n = ls->stride;
+	size_t offset = 0;
+	int i;
+
+	for (i = 0; i < CHIP8_REGCOUNT; i++) {
+		ls->reg_v[i] = carve(base, &offset, n);
+	}
+	ls->reg_i = (unsigned short *) carve(base, &offset, n * 2);
+	ls->pc = (unsigned short *) carve(base, &offset, n * 2);
+	ls->sp = (unsigned short *) carve(base, &offset, n * 2);
+	ls->reg_dt = carve(base, &offset, n);
+	ls->reg_st = carve(base, &offset, n);
+	for (i = 0; i < CHIP8_STACKSIZE; i++) {
+		ls->stack[i] = (unsigned short *) carve(base, &offset, n * 2);
+	}
+	for (i = 0; i < CHIP8_DISPLAYH; i++) {
+		ls->display[i] = (uint64_t *) carve(base, &offset, n * 8);
+	}
+	ls->ram = carve(base, &offset, n * CHIP8_RAMBYTES);
+	ls->rand_state = (uint32_t *) carve(base, &offset, n * 4);
+	ls->keys = (unsigned short *) carve(base, &offset, n * 2);
+	ls->cycles = (unsigned long *) carve(base, &offset,
+		n * sizeof(unsigned long));
+	ls->running = carve(base, &offset, n);
+	ls->fault = carve(base, &offset, n);
+	ls->mask = carve(base, &offset, n);
+	ls->todo = carve(base, &offset, n);
+	return offset;
+}
+
+/* Default LD Vx, K: the lowest key held down, or key 0 if none is */
+static byte lowest_key_down(struct chip8_lockstep *ls, size_t lane)
+{
+	byte key = chip8_lowest_key(ls->keys[lane]);
+	return key == CHIP8_KEY_NONE ? 0x0 : key;
+}
+
+/*
+ * All lanes start stopped; load each with chip8_lockstep_set. Returns NULL
+ * if memory runs out.
+ */
+struct chip8_lockstep *chip8_lockstep_new(size_t lanes)
+{
+	struct chip8_lockstep *ls = calloc(1, sizeof(*ls));
+
+	if (ls == NULL) {
+		return NULL;
+	}
+	ls->lanes = lanes;
+	ls->stride = (lanes + CHIP8_LANE_ALIGN - 1) / CHIP8_LANE_ALIGN
+		* CHIP8_LANE_ALIGN;
+	ls->block = calloc(1, lockstep_layout(ls, NULL));
+	ls->scratch = malloc(sizeof(*ls->scratch));
+	if (ls->block == NULL || ls->scratch == NULL) {
+		chip8_lockstep_free(ls);
+		return NULL;
+	}
+	lockstep_layout(ls, ls->block);
+	chip8_init(ls->scratch, NULL, NULL, NULL);
+	ls->waitkey = lowest_key_down;
+	ls->data = NULL;
+	return ls;
+}
+
+void chip8_lockstep_free(struct chip8_lockstep *ls)
+{
+	if (ls == NULL) {
+		return;
+	}
+	free(ls->block);
+	free(ls->scratch);
+	free(ls);
+}
+
+/* Copy a machine into a lane; the lane runs unless the machine halted */
+void chip8_lockstep_set(struct chip8_lockstep *ls, size_t lane,
+	struct chip8 *chip)
+{
+	int i;
+
+	for (i = 0; i < CHIP8_REGCOUNT; i++) {
+		V(ls, i, lane) = chip->reg_v[i];
+	}
+	ls->reg_i[lane] = chip->reg_i;
+	ls->pc[lane] = chip->pc;
+	ls->sp[lane] = chip->sp;
+	ls->reg_dt[lane] = chip8_getdt(chip);
+	ls->reg_st[lane] = chip8_getst(chip);
+	for (i = 0; i < CHIP8_STACKSIZE; i++) {
+		ls->stack[i][lane] = chip->stack[i];
+	}
+	for (i = 0; i < CHIP8_DISPLAYH; i++) {
+		ls->display[i][lane] = chip->display[i];
+	}
+	for (i = 0; i < CHIP8_RAMBYTES; i++) {
+		RAM(ls, i, lane) = chip->ram[i];
+	}
+	ls->rand_state[lane] = chip->rand_state;
+	ls->cycles[lane] = chip->cycles;
+	ls->running[lane] = chip->is_halted ? 0x00 : 0xFF;
+	ls->fault[lane] = chip->fault;
+}
+
+/* Copy a lane out into a machine, ready to run on the scalar engine */
+void chip8_lockstep_get(struct chip8_lockstep *ls, size_t lane,
+	struct chip8 *chip)
+{
+	int i;
+
+	for (i = 0; i < CHIP8_REGCOUNT; i++) {
+		chip->reg_v[i] = V(ls, i, lane);
+	}
+	chip->reg_i = ls->reg_i[lane];
+	chip->pc = ls->pc[lane];
+	chip->sp = ls->sp[lane];
+	chip8_setdt(chip, ls->reg_dt[lane]);
+	chip8_setst(chip, ls->reg_st[lane]);
+	for (i = 0; i < CHIP8_STACKSIZE; i++) {
+		chip->stack[i] = ls->stack[i][lane];
+	}
+	for (i = 0; i < CHIP8_DISPLAYH; i++) {
+		chip->display[i] = ls->display[i][lane];
+	}
+	for (i = 0; i < CHIP8_RAMBYTES; i++) {
+		chip->ram[i] = RAM(ls, i, lane);
+	}
+	chip8_icache_invalidate(chip, 0, CHIP8_RAMBYTES);
+	chip->rand_state = ls->rand_state[lane];
+	chip->cycles = ls->cycles[lane];
+	chip->fault = ls->fault[lane];
+	chip->display_dirty = 1;
+	/* Lanes just retry a key wait, which is always right to do */
+	chip->key_wait = 0;
+}
+
+/* Run one instruction through its handler on a scalar copy of the lane */
+static void exec_fallback(struct chip8_lockstep *ls, size_t lane,
+	unsigned short ins)
+{
+	int result;
+
+	chip8_lockstep_get(ls, lane, ls->scratch);
+	result = chip8_dispatch_table[ins](ls->scratch, ins);
+	chip8_lockstep_set(ls, lane, ls->scratch);
+	if (result != 0) {
+		ls->running[lane] = 0;
+		return;
+	}
+	ls->cycles[lane]++;
+}
+
+static void draw_lane(struct chip8_lockstep *ls, size_t lane, byte x,
+	byte y, byte n)
+{
+	unsigned short addr = ls->reg_i[lane];
+	byte vx = V(ls, x, lane);
+	byte vy = V(ls, y, lane);
+	uint64_t collision = 0;
+	uint64_t row;
+	int i;
+
+	if (vx < CHIP8_DISPLAYW) {
+		for (i = 0; i < n && vy + i < CHIP8_DISPLAYH; i++) {
+			row = (uint64_t) RAM(ls, addr + i, lane) << 56 >> vx;
+			collision |= ls->display[vy + i][lane] & row;
+			ls->display[vy + i][lane] ^= row;
+		}
+	}
+	V(ls, 0xF, lane) = collision != 0;
+}
+
+static int lane_key_down(struct chip8_lockstep *ls, size_t lane, byte key)
+{
+	return key <= 0xF && (ls->keys[lane] >> key & 0x1);
+}
+
+/* One instruction on one lane whose PC has already been advanced */
+static void exec_lane(struct chip8_lockstep *ls, size_t lane, byte op,
+	unsigned short ins)
+{
+	byte x = (ins & 0x0F00) >> 8;
+	byte y = (ins & 0x00F0) >> 4;
+	byte kk = ins & 0x00FF;
+	unsigned short nnn = ins & 0x0FFF;
+	unsigned short addr = ls->reg_i[lane];
+	unsigned int sum;
+	byte key;
+	int i;
+
+	switch (op) {
+	case CHIP8_OP_NOP:
+		break;
+	case CHIP8_OP_CLS:
+		for (i = 0; i < CHIP8_DISPLAYH; i++) {
+			ls->display[i][lane] = 0;
+		}
+		break;
+	case CHIP8_OP_RET:
+		if (ls->sp[lane] == 0) {
+			exec_fallback(ls, lane, ins);
+			return;
+		}
+		ls->pc[lane] = ls->stack[ls->sp[lane]][lane];
+		ls->sp[lane]--;
+		break;
+	case CHIP8_OP_EXIT:
+		ls->running[lane] = 0;
+		return;
+	case CHIP8_OP_JP:
+		ls->pc[lane] = nnn;
+		break;
+	case CHIP8_OP_CALL:
+		if (ls->sp[lane] + 1 >= CHIP8_STACKSIZE) {
+			exec_fallback(ls, lane, ins);
+			return;
+		}
+		ls->sp[lane]++;
+		ls->stack[ls->sp[lane]][lane] = ls->pc[lane];
+		ls->pc[lane] = nnn;
+		break;
+	case CHIP8_OP_SE_IMM:
+		if (V(ls, x, lane) == kk) {
+			ls->pc[lane] += 2;
+		}
+		break;
+	case CHIP8_OP_SNE_IMM:
+		if (V(ls, x, lane) != kk) {
+			ls->pc[lane] += 2;
+		}
+		break;
+	case CHIP8_OP_SE:
+		if (V(ls, x, lane) == V(ls, y, lane)) {
+			ls->pc[lane] += 2;
+		}
+		break;
+	case CHIP8_OP_SNE:
+		if (V(ls, x, lane) != V(ls, y, lane)) {
+			ls->pc[lane] += 2;
+		}
+		break;
+	case CHIP8_OP_LD_IMM:
+		V(ls, x, lane) = kk;
+		break;
+	case CHIP8_OP_ADD_IMM:
+		V(ls, x, lane) += kk;
+		break;
+	case CHIP8_OP_LD:
+		V(ls, x, lane) = V(ls, y, lane);
+		break;
+	case CHIP8_OP_OR:
+		V(ls, x, lane) |= V(ls, y, lane);
+		break;
+	case CHIP8_OP_AND:
+		V(ls, x, lane) &= V(ls, y, lane);
+		break;
+	/* VF is written first, exactly as the handlers do, for x or y = F */
+	case CHIP8_OP_ADD:
+		sum = V(ls, x, lane) + V(ls, y, lane);
+		V(ls, 0xF, lane) = sum > 0xFF;
+		V(ls, x, lane) = sum & 0xFF;
+		break;
+	case CHIP8_OP_SUB:
+		V(ls, 0xF, lane) = V(ls, x, lane) > V(ls, y, lane);
+		V(ls, x, lane) = V(ls, x, lane) - V(ls, y, lane);
+		break;
+	case CHIP8_OP_SHR:
+		V(ls, 0xF, lane) = V(ls, x, lane) & 0x1;
+		V(ls, x, lane) = V(ls, x, lane) >> 1;
+		break;
+	case CHIP8_OP_SUBN:
+		V(ls, 0xF, lane) = V(ls, y, lane) > V(ls, x, lane);
+		V(ls, x, lane) = V(ls, y, lane) - V(ls, x, lane);
+		break;
+	case CHIP8_OP_SHL:
+		V(ls, 0xF, lane) = V(ls, x, lane) & 0x1;
+		V(ls, x, lane) = V(ls, x, lane) << 1;
+		break;
+	case CHIP8_OP_LD_I:
+		ls->reg_i[lane] = nnn;
+		break;
+	case CHIP8_OP_JP_V0:
+		addr = nnn + V(ls, 0, lane);
+		if (addr > CHIP8_RAMBYTES || addr < CHIP8_PROGSTART) {
+			exec_fallback(ls, lane, ins);
+			return;
+		}
+		ls->pc[lane] = addr;
+		break;
+	case CHIP8_OP_RND:
+		ls->rand_state[lane] = chip8_xorshift(ls->rand_state[lane]);
+		V(ls, x, lane) = (ls->rand_state[lane] >> 24) & kk;
+		break;
+	case CHIP8_OP_DRW:
+		if (addr >= CHIP8_RAMBYTES
+			|| addr + (ins & 0x000F) > CHIP8_RAMBYTES) {
+			exec_fallback(ls, lane, ins);
+			return;
+		}
+		draw_lane(ls, lane, x, y, ins & 0x000F);
+		break;
+	case CHIP8_OP_SKP:
+		if (lane_key_down(ls, lane, V(ls, x, lane))) {
+			ls->pc[lane] += 2;
+		}
+		break;
+	case CHIP8_OP_SKNP:
+		if (!lane_key_down(ls, lane, V(ls, x, lane))) {
+			ls->pc[lane] += 2;
+		}
+		break;
+	case CHIP8_OP_LD_VX_DT:
+		V(ls, x, lane) = ls->reg_dt[lane];
+		break;
+	case CHIP8_OP_LD_VX_K:
+		key = ls->waitkey(ls, lane);
+		if (key > 0xF) {
+			ls->pc[lane] -= 2;
+		} else {
+			V(ls, x, lane) = key;
+		}
+		break;
+	case CHIP8_OP_LD_DT_VX:
+		ls->reg_dt[lane] = V(ls, x, lane);
+		break;
+	case CHIP8_OP_LD_ST_VX:
+		ls->reg_st[lane] = V(ls, x, lane);
+		break;
+	case CHIP8_OP_LD_F_VX:
+		if (V(ls, x, lane) <= 0xF) {
+			ls->reg_i[lane] = CHIP8_FONTSTART
+				+ V(ls, x, lane) * CHIP8_FONTWIDTH;
+		}
+		break;
+	case CHIP8_OP_LD_B_VX:
+		if (addr + 2 >= CHIP8_RAMBYTES) {
+			exec_fallback(ls, lane, ins);
+			return;
+		}
+		RAM(ls, addr, lane) = V(ls, x, lane) / 100;
+		RAM(ls, addr + 1, lane) = V(ls, x, lane) / 10 % 10;
+		RAM(ls, addr + 2, lane) = V(ls, x, lane) % 10;
+		break;
+	case CHIP8_OP_LD_I_VX:
+		if (addr < CHIP8_PROGSTART || addr + x >= CHIP8_RAMBYTES) {
+			exec_fallback(ls, lane, ins);
+			return;
+		}
+		for (i = 0; i <= x; i++) {
+			RAM(ls, addr + i, lane) = V(ls, i, lane);
+		}
+		break;
+	case CHIP8_OP_LD_VX_I:
+		if (x > 0xE) {
+			x = 0xE;
+		}
+		if (addr < CHIP8_PROGSTART || addr + x >= CHIP8_RAMBYTES) {
+			exec_fallback(ls, lane, ins);
+			return;
+		}
+		for (i = 0; i <= x; i++) {
+			V(ls, i, lane) = RAM(ls, addr + i, lane);
+		}
+		break;
+	default:
+		exec_fallback(ls, lane, ins);
+		return;
+	}
+	ls->cycles[lane]++;
+}
+
+
+#ifdef __SSE2__
+static __m128i load16(const byte *p)
+{
+	return _mm_loadu_si128((const __m128i *) p);
+}
+
+/* Write v to the lanes of p selected by m, leaving the rest alone */
+static void store16(byte *p, __m128i m, __m128i v)
+{
+	v = _mm_or_si128(_mm_and_si128(m, v), _mm_andnot_si128(m, load16(p)));
+	_mm_storeu_si128((__m128i *) p, v);
+}
+
+/* The same for 8 lanes of 16 bits */
+static __m128i load8w(const unsigned short *p)
+{
+	return _mm_loadu_si128((const __m128i *) p);
+}
+
+static void store8w(unsigned short *p, __m128i m, __m128i v)
+{
+	__m128i old = load8w(p);
+	v = _mm_or_si128(_mm_and_si128(m, v), _mm_andnot_si128(m, old));
+	_mm_storeu_si128((__m128i *) p, v);
+}
+
+/* Unsigned a > b, as 0xFF or 0x00 per lane */
+static __m128i greater16(__m128i a, __m128i b)
+{
+	__m128i le = _mm_cmpeq_epi8(_mm_max_epu8(a, b), b);
+	return _mm_xor_si128(le, _mm_set1_epi8(-1));
+}
+#endif
+
+/* Bit i is set if lane i of the 16 starting at mask is */
+static unsigned int lane_bits(const byte *mask)
+{
+#ifdef __SSE2__
+	return _mm_movemask_epi8(load16(mask));
+#else
+	unsigned int bits = 0;
+	int i;
+	for (i = 0; i < CHIP8_LANE_ALIGN; i++) {
+		if (mask[i]) {
+			bits |= 1u << i;
+		}
+	}
+	return bits;
+#endif
+}
+
+/*
+ * Move the lanes still to be stepped that are at pc, with ins there, from
+ * ls->todo to ls->mask; returns how many there are
+ */
+static size_t build_group(struct chip8_lockstep *ls, unsigned short pc,
+	unsigned short ins)
+{
+	const byte *hi = &RAM(ls, pc, 0);
+	const byte *lo = &RAM(ls, pc + 1, 0);
+	size_t count = 0;
+	size_t o;
+#ifdef __SSE2__
+	const __m128i vpc = _mm_set1_epi16((short) pc);
+	const __m128i vhi = _mm_set1_epi8((char) (ins >> 8));
+	const __m128i vlo = _mm_set1_epi8((char) (ins & 0xFF));
+	__m128i todo, at, m;
+
+	for (o = 0; o < ls->stride; o += CHIP8_LANE_ALIGN) {
+		todo = load16(ls->todo + o);
+		m = _mm_setzero_si128();
+		if (_mm_movemask_epi8(todo) != 0) {
+			at = _mm_packs_epi16(
+				_mm_cmpeq_epi16(load8w(ls->pc + o), vpc),
+				_mm_cmpeq_epi16(load8w(ls->pc + o + 8), vpc));
+			m = _mm_and_si128(todo, at);
+			m = _mm_and_si128(m,
+				_mm_cmpeq_epi8(load16(hi + o), vhi));
+			m = _mm_and_si128(m,
+				_mm_cmpeq_epi8(load16(lo + o), vlo));
+			_mm_storeu_si128((__m128i *) (ls->todo + o),
+				_mm_andnot_si128(m, todo));
+			count += __builtin_popcount(_mm_movemask_epi8(m));
+		}
+		_mm_storeu_si128((__m128i *) (ls->mask + o), m);
+	}
+#else
+	for (o = 0; o < ls->stride; o++) {
+		ls->mask[o] = 0x00;
+		if (ls->todo[o] && ls->pc[o] == pc && hi[o] == ins >> 8
+			&& lo[o] == (ins & 0xFF)) {
+			ls->mask[o] = 0xFF;
+			ls->todo[o] = 0x00;
+			count++;
+		}
+	}
+#endif
+	return count;
+}
+
+#ifdef __SSE2__
+static int is_vector_op(byte op)
+{
+	switch (op) {
+	case CHIP8_OP_JP:
+	case CHIP8_OP_SE_IMM:
+	case CHIP8_OP_SNE_IMM:
+	case CHIP8_OP_SE:
+	case CHIP8_OP_SNE:
+	case CHIP8_OP_LD_IMM:
+	case CHIP8_OP_ADD_IMM:
+	case CHIP8_OP_LD:
+	case CHIP8_OP_OR:
+	case CHIP8_OP_AND:
+	case CHIP8_OP_ADD:
+	case CHIP8_OP_SUB:
+	case CHIP8_OP_SHR:
+	case CHIP8_OP_SUBN:
+	case CHIP8_OP_SHL:
+	case CHIP8_OP_LD_I:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Execute ins at pc on every lane in ls->mask, 16 lanes at a time */
+static void exec_vector(struct chip8_lockstep *ls, byte op,
+	unsigned short pc, unsigned short ins)
+{
+	byte x = (ins & 0x0F00) >> 8;
+	byte y = (ins & 0x00F0) >> 4;
+	const __m128i k = _mm_set1_epi8((char) (ins & 0x00FF));
+	const __m128i nnn = _mm_set1_epi16((short) (ins & 0x0FFF));
+	const __m128i one = _mm_set1_epi8(1);
+	const __m128i ones = _mm_set1_epi8(-1);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i m, vx, vy, res, skip, next, step;
+	unsigned int bits;
+	size_t o;
+
+	next = op == CHIP8_OP_JP ? nnn : _mm_set1_epi16((short) (pc + 2));
+	for (o = 0; o < ls->stride; o += CHIP8_LANE_ALIGN) {
+		m = load16(ls->mask + o);
+		bits = _mm_movemask_epi8(m);
+		if (bits == 0) {
+			continue;
+		}
+		vx = load16(ls->reg_v[x] + o);
+		vy = load16(ls->reg_v[y] + o);
+		skip = zero;
+		switch (op) {
+		case CHIP8_OP_SE_IMM:
+			skip = _mm_cmpeq_epi8(vx, k);
+			break;
+		case CHIP8_OP_SNE_IMM:
+			skip = _mm_xor_si128(_mm_cmpeq_epi8(vx, k), ones);
+			break;
+		case CHIP8_OP_SE:
+			skip = _mm_cmpeq_epi8(vx, vy);
+			break;
+		case CHIP8_OP_SNE:
+			skip = _mm_xor_si128(_mm_cmpeq_epi8(vx, vy), ones);
+			break;
+		case CHIP8_OP_LD_I:
+			store8w(ls->reg_i + o, _mm_unpacklo_epi8(m, m), nnn);
+			store8w(ls->reg_i + o + 8,
+				_mm_unpackhi_epi8(m, m), nnn);
+			break;
+		case CHIP8_OP_LD_IMM:
+			store16(ls->reg_v[x] + o, m, k);
+			break;
+		case CHIP8_OP_ADD_IMM:
+			store16(ls->reg_v[x] + o, m, _mm_add_epi8(vx, k));
+			break;
+		case CHIP8_OP_LD:
+			store16(ls->reg_v[x] + o, m, vy);
+			break;
+		case CHIP8_OP_OR:
+			store16(ls->reg_v[x] + o, m, _mm_or_si128(vx, vy));
+			break;
+		case CHIP8_OP_AND:
+			store16(ls->reg_v[x] + o, m, _mm_and_si128(vx, vy));
+			break;
+		/* VF is written first, as in the handlers, for x or y = F */
+		case CHIP8_OP_ADD:
+			res = _mm_add_epi8(vx, vy);
+			/* The sum wrapped iff it came out below Vx */
+			store16(ls->reg_v[0xF] + o, m,
+				_mm_and_si128(greater16(vx, res), one));
+			store16(ls->reg_v[x] + o, m, res);
+			break;
+		case CHIP8_OP_SUB:
+			store16(ls->reg_v[0xF] + o, m,
+				_mm_and_si128(greater16(vx, vy), one));
+			vx = load16(ls->reg_v[x] + o);
+			vy = load16(ls->reg_v[y] + o);
+			store16(ls->reg_v[x] + o, m, _mm_sub_epi8(vx, vy));
+			break;
+		case CHIP8_OP_SUBN:
+			store16(ls->reg_v[0xF] + o, m,
+				_mm_and_si128(greater16(vy, vx), one));
+			vx = load16(ls->reg_v[x] + o);
+			vy = load16(ls->reg_v[y] + o);
+			store16(ls->reg_v[x] + o, m, _mm_sub_epi8(vy, vx));
+			break;
+		case CHIP8_OP_SHR:
+			store16(ls->reg_v[0xF] + o, m, _mm_and_si128(vx, one));
+			vx = load16(ls->reg_v[x] + o);
+			res = _mm_and_si128(_mm_srli_epi16(vx, 1),
+				_mm_set1_epi8(0x7F));
+			store16(ls->reg_v[x] + o, m, res);
+			break;
+		case CHIP8_OP_SHL:
+			store16(ls->reg_v[0xF] + o, m, _mm_and_si128(vx, one));
+			vx = load16(ls->reg_v[x] + o);
+			store16(ls->reg_v[x] + o, m, _mm_add_epi8(vx, vx));
+			break;
+		default:
+			break;
+		}
+		/* Lanes that skip land 4 bytes on instead of 2 */
+		step = _mm_and_si128(skip, _mm_set1_epi8(2));
+		store8w(ls->pc + o, _mm_unpacklo_epi8(m, m),
+			_mm_add_epi16(next, _mm_unpacklo_epi8(step, zero)));
+		store8w(ls->pc + o + 8, _mm_unpackhi_epi8(m, m),
+			_mm_add_epi16(next, _mm_unpackhi_epi8(step, zero)));
+		for (; bits != 0; bits &= bits - 1) {
+			ls->cycles[o + __builtin_ctz(bits)]++;
+		}
+	}
+}
+#endif
+
+/*
+ * Execute ins on the count lanes in ls->mask, all at pc. Groups that cover
+ * a good share of the lanes run on vectors where the op allows it.
+ */
+static void exec_group(struct chip8_lockstep *ls, size_t count,
+	unsigned short pc, unsigned short ins)
+{
+	byte op = chip8_op_table[ins];
+	unsigned int bits;
+	size_t lane;
+	size_t o;
+
+#ifdef __SSE2__
+	if (is_vector_op(op) && count * CHIP8_LANE_ALIGN >= ls->stride) {
+		exec_vector(ls, op, pc, ins);
+		return;
+	}
+#else
+	(void) count;
+#endif
+	for (o = 0; o < ls->stride; o += CHIP8_LANE_ALIGN) {
+		for (bits = lane_bits(ls->mask + o); bits; bits &= bits - 1) {
+			lane = o + __builtin_ctz(bits);
+			ls->pc[lane] = pc + 2;
+			exec_lane(ls, lane, op, ins);
+		}
+	}
+}
+
+/*
+ * Execute one instruction on every running lane. A lane stops when it
+ * exits or its PC runs off the end of RAM, as chip8_interpret does.
+ * Returns how many lanes executed an instruction.
+ */
+size_t chip8_lockstep_step(struct chip8_lockstep *ls)
+{
+	size_t active = 0;
+	size_t count;
+	size_t lane;
+	size_t o;
+	unsigned int bits;
+	unsigned short pc;
+	unsigned short ins;
+	int groups = 0;
+
+	memcpy(ls->todo, ls->running, ls->stride);
+	for (o = 0; o < ls->stride; o += CHIP8_LANE_ALIGN) {
+		while ((bits = lane_bits(ls->todo + o)) != 0) {
+			lane = o + __builtin_ctz(bits);
+			pc = ls->pc[lane];
+			if (pc + 2 >= CHIP8_RAMBYTES) {
+				ls->running[lane] = 0x00;
+				ls->todo[lane] = 0x00;
+				continue;
+			}
+			ins = RAM(ls, pc, lane) << 8 | RAM(ls, pc + 1, lane);
+			if (groups < MAX_GROUPS) {
+				count = build_group(ls, pc, ins);
+				exec_group(ls, count, pc, ins);
+				active += count;
+				groups++;
+				continue;
+			}
+			ls->todo[lane] = 0x00;
+			ls->pc[lane] = pc + 2;
+			exec_lane(ls, lane, chip8_op_table[ins], ins);
+			active++;
+		}
+	}
+	return active;
+}
+
+/* Count the delay and sound timers of the running lanes down by one */
+void chip8_lockstep_tick(struct chip8_lockstep *ls)
+{
+	size_t lane = 0;
+#ifdef __SSE2__
+	const __m128i one = _mm_set1_epi8(1);
+	__m128i dec;
+
+	for (; lane < ls->stride; lane += CHIP8_LANE_ALIGN) {
+		dec = _mm_and_si128(load16(ls->running + lane), one);
+		_mm_storeu_si128((__m128i *) (ls->reg_dt + lane),
+			_mm_subs_epu8(load16(ls->reg_dt + lane), dec));
+		_mm_storeu_si128((__m128i *) (ls->reg_st + lane),
+			_mm_subs_epu8(load16(ls->reg_st + lane), dec));
+	}
+#endif
+	for (; lane < ls->lanes; lane++) {
+		if (!ls->running[lane]) {
+			continue;
+		}
+		if (ls->reg_dt[lane] > 0) {
+			ls->reg_dt[lane]--;
+		}
+		if (ls->reg_st[lane] > 0) {
+			ls->reg_st[lane]--;
+		}
+	}
+}
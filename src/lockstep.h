@@ -0,0 +1,68 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stddef.h>
+#include "chip8.h"
+
+/* Lane arrays are padded to a whole number of SIMD vectors */
+#define CHIP8_LANE_ALIGN 16
+
+struct chip8_lockstep;
+
+/*
+ * Called for LD Vx, K; returns the key pressed in that lane, or
+ * CHIP8_KEY_NONE to run the instruction again
+ */
+typedef byte (*chip8_lane_waitkey)(struct chip8_lockstep *ls, size_t lane);
+
+/*
+ * Many machines in structure-of-arrays form: element [lane] of each array
+ * belongs to one machine. Lanes at the same PC are stepped together.
+ */
+struct chip8_lockstep {
+	size_t lanes;
+	size_t stride;
+	byte *reg_v[CHIP8_REGCOUNT];
+	unsigned short *reg_i;
+	unsigned short *pc;
+	unsigned short *sp;
+	byte *reg_dt;
+	byte *reg_st;
+	unsigned short *stack[CHIP8_STACKSIZE];
+	uint64_t *display[CHIP8_DISPLAYH];
+	byte *ram; /* ram[addr * stride + lane], so one address is a vector */
+	uint32_t *rand_state;
+	unsigned short *keys; /* Bit k is set while key k is down */
+	unsigned long *cycles;
+	byte *running; /* 0xFF until the lane exits or runs off the end */
+	byte *fault; /* The enum chip8_fault the lane stopped on, if any */
+	chip8_lane_waitkey waitkey;
+	void *data;
+
+	/* Scratch space for chip8_lockstep_step */
+	byte *mask;
+	byte *todo;
+	struct chip8 *scratch;
+	void *block;
+};
+
+struct chip8_lockstep *chip8_lockstep_new(size_t lanes);
+void chip8_lockstep_free(struct chip8_lockstep *ls);
+void chip8_lockstep_set(struct chip8_lockstep *ls, size_t lane,
+	struct chip8 *chip);
+void chip8_lockstep_get(struct chip8_lockstep *ls, size_t lane,
+	struct chip8 *chip);
+size_t chip8_lockstep_step(struct chip8_lockstep *ls);
+void chip8_lockstep_tick(struct chip8_lockstep *ls);
+
+#endif /* LOCKSTEP_H */
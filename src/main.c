@@ -10,13 +10,25 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "chip8.h"
+#include "fuse.h"
+#include "dispatch.h"
+#include "expand.h"
+#include "headless.h"
+#include "input.h"
+#include "rewind.h"
+#include "savestate.h"
+#include "profile.h"
+#include "clock.h"
 #include "SDL.h"
-#include <pthread.h>
 #include <unistd.h>
 #include <math.h>
 
-#define USAGE_FMT "Usage: %s [FILE_NAME]\n"
+#define USAGE_FMT "Usage: %s [-sFHw] [-e table|threaded|jit|aot] " \
+	"[-c CYCLES] [-f FRAMES] [-i IPF] [-x N] [-r SEED] " \
+	"[-R LOG | -P LOG] [-S STATE] [-p PROFILE [-m MAP]] [FILE_NAME]\n"
 #define DISPLAY_WPIXELS CHIP8_DISPLAYW
 #define DISPLAY_HPIXELS CHIP8_DISPLAYH
 #define CHIP8_PIXEL_HEIGHT 10
@@ -26,17 +38,104 @@
 #define VOLUME 127.0
 #define SAMPLES 8192
 
+#define COLOR_ON 0xFFFFFFFF
+#define COLOR_OFF 0xFF000000
+
+/* Instructions run between looks at the frame clock */
+#define CLOCK_SLICE 64
+
+/* With -S, the state is saved this often as well as on F5 */
+#define CHECKPOINT_FRAMES (10 * 60)
+
+/* Holding Tab fast-forwards, showing one frame in this many */
+#define TURBO_PRESENT_EVERY 4
+
+/* A host behind by a second gets frames 1/8 shorter than it managed */
+#define IPF_HEADROOM 8
+
+/* Each second it keeps up, frames grow back by 1/16 */
+#define IPF_GROWTH 16
+
+/* Streaming-texture display: the ROM's 64x32 pixels, scaled by SDL */
+struct sdl_display {
+	SDL_Renderer *renderer;
+	SDL_Texture *texture;
+	uint32_t pixels[CHIP8_PIXELS];
+};
+
+/*
+ * With -i or -x, and when recording or replaying input, the machine runs on
+ * virtual time, as headless runs do: a frame is ipf instructions, keys are
+ * latched once per frame, and the timers tick per frame. Wall time only
+ * paces the frames, one per frame of the clock. A host that cannot keep up
+ * is told so, and gets fewer instructions a frame until it can, then the
+ * asked-for number again; with a log, whose frames must stay ipf long, the
+ * machine runs slower instead. While fast-forwarding, nothing waits for the
+ * clock and only one frame in present_every is shown.
+ */
+struct scheduler {
+	struct chip8_input *input; /* NULL unless recording or replaying */
+	int is_recording;
+	unsigned int ipf; /* The length of a frame now */
+	unsigned int target_ipf; /* What -i asked for */
+	unsigned int present_every; /* With -x; 0 unless fast-forwarding */
+	unsigned long frames;
+	unsigned long base_frames; /* Frame ipf last changed at */
+	unsigned long base_cycles; /* and the cycle count it began at */
+	unsigned long late; /* Clock frames that passed with no frame run */
+	unsigned long window_start; /* Frame the current second began at */
+	unsigned long window_clock; /* Clock frames since then */
+};
+
+static struct scheduler scheduler;
+static int virtual_timers = 0;
+static int fast_forward = 0; /* The display is left to the scheduler */
+
+/*
+ * The 60 Hz frame clock. The emulation thread looks at it every so many
+ * instructions and does a frame's work itself when one is due: the timers,
+ * SDL events, the display and the sound. No other thread touches the
+ * machine.
+ */
+static struct chip8_clock frame_clock;
+
+/* With -w, the state is captured or undone once every wall frame */
+static struct chip8_rewind *rewind_buffer = NULL;
+static unsigned long wall_frames = 0; /* Frames the clock has started */
+
+/* With -S, F5 saves to state_file in the background and F9 loads it */
+static struct chip8_saver *saver = NULL;
+static const char *state_file = NULL;
+
+/* The first key pressed while LD Vx, K waits, or CHIP8_KEY_NONE */
+static byte key_pressed = CHIP8_KEY_NONE;
+
+/* With -p, the counts the profiling engine keeps */
+static struct chip8_profile profile;
+
 static void *setup_renderer(struct chip8_renderer *c8renderer);
 static void teardown_display();
 static void clear_screen(void *renderer_p);
 static void setup_keyboard(struct chip8_keyboard *keyboard);
 static void render_display(struct chip8 *chip);
-static void render_black(SDL_Renderer *renderer);
-static void render_white(SDL_Renderer *renderer);
-static byte waitkey();
-static int is_key_down(byte key);
-static void *timer_thread_update(void *arg);
+static byte key_from_sym(SDL_Keycode sym);
+static int wants_key(struct chip8 *chip);
+static void poll_events(struct chip8 *chip, int want_key);
+static byte waitkey(struct chip8 *chip);
+static int is_key_down(struct chip8 *chip, byte key);
+static void setup_audio(void);
+static void wall_frame(struct chip8 *chip, unsigned long frames);
 static void check_kill(struct chip8 *chip);
+static void idle_wait(struct chip8 *chip);
+static void schedule_check(struct chip8 *chip);
+static void schedule_frame(struct chip8 *chip);
+static void rewind_frame(struct chip8 *chip);
+static void checkpoint_frame(struct chip8 *chip);
+static unsigned short sample_keys(struct chip8 *chip);
+static byte record_waitkey(struct chip8 *chip);
+static int parse_engine(const char *name, enum chip8_engine *engine);
+static unsigned long parse_count(const char *arg);
+static double now_seconds();
 
 int main(int argc, char *argv[])
 {
@@ -44,36 +143,335 @@ int main(int argc, char *argv[])
 	char *file_name;
 	struct chip8_keyboard keyboard;
 	struct chip8_renderer c8renderer;
-	pthread_t timer_thread;
-	void *renderer;
-
-	if (argc < 2) {
+	struct chip8_headless headless;
+	struct chip8_input input;
+	char *record_file = NULL;
+	char *replay_file = NULL;
+	char *profile_file = NULL;
+	char *map_file = NULL;
+	uint32_t seed;
+	int has_seed;
+	void *renderer = NULL;
+	extern char *optarg;
+	extern int optind;
+	int opt;
+	enum chip8_engine engine;
+	int show_stats;
+	int fusion_enabled;
+	int is_headless;
+	int use_rewind;
+	unsigned int ipf;
+	unsigned int present_every;
+	int i;
+	double start, elapsed;
+
+	engine = CHIP8_ENGINE_TABLE;
+	show_stats = 0;
+	fusion_enabled = 1;
+	is_headless = 0;
+	use_rewind = 0;
+	ipf = 0;
+	present_every = 0;
+	headless.max_cycles = 0;
+	headless.max_frames = 0;
+	headless.ipf = 0;
+	headless.input = NULL;
+	seed = time(NULL);
+	has_seed = 0;
+	while ((opt = getopt(argc, argv, "e:sFHwc:f:i:x:r:R:P:S:p:m:")) > 0) {
+		switch (opt) {
+		case 'e':
+			if (parse_engine(optarg, &engine) < 0) {
+				fprintf(stderr, "Unknown engine: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 's':
+			show_stats = 1;
+			break;
+		case 'F':
+			fusion_enabled = 0;
+			break;
+		case 'H':
+			is_headless = 1;
+			break;
+		case 'w':
+			use_rewind = 1;
+			break;
+		case 'c':
+			headless.max_cycles = parse_count(optarg);
+			break;
+		case 'f':
+			headless.max_frames = parse_count(optarg);
+			break;
+		case 'i':
+			ipf = parse_count(optarg);
+			if (ipf == 0) {
+				fprintf(stderr, "-i needs at least one "
+					"instruction per frame\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'x':
+			present_every = parse_count(optarg);
+			if (present_every == 0) {
+				fprintf(stderr, "-x needs a frame to show "
+					"every so often\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'r':
+			seed = parse_count(optarg);
+			has_seed = 1;
+			break;
+		case 'R':
+			record_file = optarg;
+			break;
+		case 'P':
+			replay_file = optarg;
+			break;
+		case 'S':
+			state_file = optarg;
+			break;
+		case 'p':
+			profile_file = optarg;
+			break;
+		case 'm':
+			map_file = optarg;
+			break;
+		default:
+			printf(USAGE_FMT, argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (optind >= argc) {
 		printf(USAGE_FMT, argv[0]);
 		exit(EXIT_FAILURE);
 	}
-	renderer = setup_renderer(&c8renderer);
-	setup_keyboard(&keyboard);
-	chip8_init(&chip, &keyboard, &c8renderer, check_kill);
-	file_name = argv[1];
+	if ((headless.max_cycles || headless.max_frames) && !is_headless) {
+		fprintf(stderr, "-c and -f need -H\n");
+		exit(EXIT_FAILURE);
+	}
+	if (record_file && (replay_file || is_headless)) {
+		fprintf(stderr, "-R cannot be used with -P or -H\n");
+		exit(EXIT_FAILURE);
+	}
+	if (present_every && is_headless) {
+		fprintf(stderr, "-x cannot be used with -H\n");
+		exit(EXIT_FAILURE);
+	}
+	if ((record_file || replay_file || (ipf && !is_headless)
+		|| present_every) && engine == CHIP8_ENGINE_JIT) {
+		fprintf(stderr, "-R, -P, -i and -x need an engine that stops "
+			"after every instruction\n");
+		exit(EXIT_FAILURE);
+	}
+	if (use_rewind && (is_headless || record_file || replay_file)) {
+		fprintf(stderr, "-w cannot be used with -H, -R or -P\n");
+		exit(EXIT_FAILURE);
+	}
+	if (use_rewind && (engine == CHIP8_ENGINE_JIT
+		|| engine == CHIP8_ENGINE_AOT)) {
+		fprintf(stderr, "-w needs the table or threaded engine\n");
+		exit(EXIT_FAILURE);
+	}
+	if (profile_file && engine != CHIP8_ENGINE_TABLE) {
+		fprintf(stderr, "-p runs its own engine and cannot be used "
+			"with -e\n");
+		exit(EXIT_FAILURE);
+	}
+	if (map_file && !profile_file) {
+		fprintf(stderr, "-m needs -p\n");
+		exit(EXIT_FAILURE);
+	}
+	if (state_file && (record_file || replay_file)) {
+		fprintf(stderr, "-S cannot be used with -R or -P\n");
+		exit(EXIT_FAILURE);
+	}
+	if (state_file && !is_headless && (engine == CHIP8_ENGINE_JIT
+		|| engine == CHIP8_ENGINE_AOT)) {
+		fprintf(stderr, "-S needs the table or threaded engine\n");
+		exit(EXIT_FAILURE);
+	}
+	if (state_file) {
+		saver = chip8_saver_new();
+		if (saver == NULL) {
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (profile_file) {
+		chip8_profile_init(&profile, profile_file);
+		if (map_file && chip8_profile_load_symbols(&profile,
+			map_file) < 0) {
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (use_rewind) {
+		rewind_buffer = chip8_rewind_new(CHIP8_REWIND_BUDGET, 0);
+		if (rewind_buffer == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	chip8_input_init(&input);
+	if (replay_file && chip8_input_load(&input, replay_file) < 0) {
+		exit(EXIT_FAILURE);
+	}
+	if (input.has_seed && !has_seed) {
+		seed = input.seed;
+	}
+	if (is_headless) {
+		headless.input = replay_file ? &input : NULL;
+		headless.ipf = ipf;
+		chip8_headless_setup(&headless, &c8renderer, &keyboard);
+		chip8_init(&chip, &keyboard, &c8renderer,
+			chip8_headless_check);
+	} else if (record_file || replay_file || ipf || present_every) {
+		renderer = setup_renderer(&c8renderer);
+		scheduler.input = NULL;
+		if (record_file || replay_file) {
+			chip8_input_keyboard(&input, &keyboard);
+			scheduler.input = &input;
+		} else {
+			setup_keyboard(&keyboard);
+		}
+		if (record_file) {
+			keyboard.waitkey = record_waitkey;
+		}
+		scheduler.is_recording = record_file != NULL;
+		scheduler.ipf = ipf ? ipf : CHIP8_HEADLESS_IPF;
+		scheduler.target_ipf = scheduler.ipf;
+		scheduler.base_frames = 0;
+		scheduler.base_cycles = 0;
+		scheduler.present_every = present_every;
+		scheduler.frames = 0;
+		scheduler.late = 0;
+		scheduler.window_start = 0;
+		scheduler.window_clock = 0;
+		virtual_timers = 1;
+		chip8_init(&chip, &keyboard, &c8renderer, schedule_check);
+	} else {
+		renderer = setup_renderer(&c8renderer);
+		setup_keyboard(&keyboard);
+		chip8_init(&chip, &keyboard, &c8renderer, check_kill);
+		chip.idle = idle_wait;
+	}
+	chip8_seed(&chip, seed);
+	chip.engine = engine;
+	if (profile_file) {
+		chip.profile = &profile;
+		chip.engine = CHIP8_ENGINE_PROFILE;
+	}
+	/*
+	 * Fused sequences stop short of idle_until, which headless runs keep
+	 * at the next frame or the cycle limit. A log's frame boundaries and
+	 * the frames the scheduler gives ipf instructions are left unfused.
+	 */
+	chip.fusion_enabled = fusion_enabled
+		&& !record_file && !replay_file
+		&& (is_headless || (!ipf && !present_every));
+	file_name = argv[optind];
 	if (chip8_load(&chip, file_name) < 0) {
-		teardown_display();
+		if (!is_headless) {
+			teardown_display();
+		}
 		exit(EXIT_FAILURE);
 	}
-	clear_screen(renderer);
-	pthread_create(&timer_thread, NULL, timer_thread_update, &chip);
+	if (!is_headless) {
+		clear_screen(renderer);
+		setup_audio();
+		if (chip8_clock_init(&frame_clock, CHIP8_CLOCK_HZ) < 0) {
+			teardown_display();
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (record_file) {
+		chip8_input_record(&input, 0, sample_keys(&chip));
+	} else if (replay_file && !is_headless) {
+		chip8_input_frame(&input, 0);
+	}
+	start = now_seconds();
 	chip8_exec(&chip);
-	pthread_join(timer_thread, NULL);
-	teardown_display();
+	elapsed = now_seconds() - start;
+	if (chip.fault != CHIP8_FAULT_NONE) {
+		fprintf(stderr, "%s at 0x%03X\n",
+			chip8_fault_names[chip.fault], chip.pc - 2);
+	}
+	if (is_headless) {
+		chip8_headless_report(&chip, stdout, elapsed);
+		if (saver != NULL) {
+			chip8_saver_save(saver, &chip, state_file);
+		}
+	} else {
+		chip8_clock_free(&frame_clock);
+		teardown_display();
+	}
+	if (record_file && chip8_input_save(&input, record_file, seed) < 0) {
+		exit(EXIT_FAILURE);
+	}
+	chip8_input_free(&input);
+	chip8_rewind_free(rewind_buffer);
+	chip8_saver_free(saver);
+	if (show_stats) {
+		fprintf(stderr, "%lu instructions in %.3f s (%.0f ins/s)\n",
+			chip.cycles, elapsed,
+			elapsed > 0 ? chip.cycles / elapsed : 0.0);
+		for (i = CHIP8_FUSE_NONE + 1; i < CHIP8_FUSE_COUNT; i++) {
+			fprintf(stderr, "fusion %-12s %lu\n",
+				chip8_fusion_names[i], chip.fusion_hits[i]);
+		}
+		fprintf(stderr, "idle %lu instructions skipped, %lu waits\n",
+			chip.idle_cycles, chip.idle_waits);
+		if (virtual_timers) {
+			fprintf(stderr, "%lu frames, %lu clock frames late\n",
+				scheduler.frames, scheduler.late);
+		}
+	}
 
+	return chip.fault == CHIP8_FAULT_NONE ? 0 : EXIT_FAILURE;
+}
+
+static int parse_engine(const char *name, enum chip8_engine *engine)
+{
+	if (strcmp(name, "table") == 0) {
+		*engine = CHIP8_ENGINE_TABLE;
+	} else if (strcmp(name, "threaded") == 0) {
+		*engine = CHIP8_ENGINE_THREADED;
+	} else if (strcmp(name, "jit") == 0) {
+		*engine = CHIP8_ENGINE_JIT;
+	} else if (strcmp(name, "aot") == 0) {
+		*engine = CHIP8_ENGINE_AOT;
+	} else {
+		return -1;
+	}
 	return 0;
 }
 
+static unsigned long parse_count(const char *arg)
+{
+	char *end;
+	unsigned long count = strtoul(arg, &end, 10);
+	if (*arg == '\0' || *end != '\0') {
+		fprintf(stderr, "Not a count: %s\n", arg);
+		exit(EXIT_FAILURE);
+	}
+	return count;
+}
+
+static double now_seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 static void *setup_renderer(struct chip8_renderer *c8renderer)
 {
 	int disph, dispw;
 	int ret;
 	SDL_Window *window = NULL;
 	SDL_Renderer *renderer = NULL;
+	static struct sdl_display display;
 
 	dispw = DISPLAY_WPIXELS * CHIP8_PIXEL_WIDTH;
 	disph = DISPLAY_HPIXELS * CHIP8_PIXEL_HEIGHT;
@@ -88,7 +486,16 @@ static void *setup_renderer(struct chip8_renderer *c8renderer)
 		perror("SDL_CreateWindowAndRenderer");
 		exit(EXIT_FAILURE);
 	}
-	c8renderer->data = renderer;
+	display.renderer = renderer;
+	display.texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+		SDL_TEXTUREACCESS_STREAMING, DISPLAY_WPIXELS, DISPLAY_HPIXELS);
+	if (display.texture == NULL) {
+		fprintf(stderr, "SDL_CreateTexture failed: %s\n",
+			SDL_GetError());
+		SDL_Quit();
+		exit(EXIT_FAILURE);
+	}
+	c8renderer->data = &display;
 	c8renderer->render_display = render_display;
 
 	return renderer;
@@ -96,6 +503,7 @@ static void *setup_renderer(struct chip8_renderer *c8renderer)
 
 static void setup_keyboard(struct chip8_keyboard *keyboard)
 {
+	keyboard->data = NULL;
 	keyboard->waitkey = waitkey;
 	keyboard->is_key_down = is_key_down;
 }
@@ -109,115 +517,97 @@ static void clear_screen(void *renderer_p)
 
 static void render_display(struct chip8 *chip)
 {
-	SDL_Rect pixel;
-	SDL_Renderer *renderer = chip->renderer->data;
-	int i, j;
-	byte bit;
-
-	SDL_SetRenderDrawColor(renderer, 0, 0, 0, SDL_ALPHA_OPAQUE);
-	SDL_RenderClear(renderer);
-
-	for (i = 0; i < CHIP8_DISPLAYH; i++) {
-		for (j = 0; j < CHIP8_DISPLAYW; j++) {
-			bit = chip8_getpixel(chip, j, i);
-			pixel.x = j * CHIP8_PIXEL_WIDTH;
-			pixel.y = i * CHIP8_PIXEL_HEIGHT;
-			pixel.w = CHIP8_PIXEL_WIDTH;
-			pixel.h = CHIP8_PIXEL_HEIGHT;
-
-			if (bit == 0) {
-				render_black(renderer);
-			} else {
-				render_white(renderer);
-			}
-
-			if (SDL_RenderFillRect(renderer, &pixel) != 0) {
-				fprintf(stderr,
-					"SDL_RenderFillRect failed: %s\n",
-					SDL_GetError());
-			}
-		}
+	struct sdl_display *display = chip->renderer->data;
+
+	chip8_expand_display(chip, display->pixels, COLOR_ON, COLOR_OFF);
+	if (SDL_UpdateTexture(display->texture, NULL, display->pixels,
+		sizeof(uint32_t) * DISPLAY_WPIXELS) != 0) {
+		fprintf(stderr, "SDL_UpdateTexture failed: %s\n",
+			SDL_GetError());
+		return;
 	}
-	SDL_RenderPresent(renderer);
+	SDL_RenderCopy(display->renderer, display->texture, NULL, NULL);
+	SDL_RenderPresent(display->renderer);
 }
 
-static void render_black(SDL_Renderer *renderer)
+/* The key on the hex keypad that sym is mapped to, or CHIP8_KEY_NONE */
+static byte key_from_sym(SDL_Keycode sym)
 {
-	SDL_SetRenderDrawColor(renderer, 0, 0, 0, SDL_ALPHA_OPAQUE);
+	switch (sym) {
+	case SDLK_7:
+		return 0x1;
+	case SDLK_8:
+		return 0x2;
+	case SDLK_9:
+		return 0x3;
+	case SDLK_0:
+		return 0xC;
+	case SDLK_u:
+		return 0x4;
+	case SDLK_i:
+		return 0x5;
+	case SDLK_o:
+		return 0x6;
+	case SDLK_p:
+		return 0xD;
+	case SDLK_j:
+		return 0x7;
+	case SDLK_k:
+		return 0x8;
+	case SDLK_l:
+		return 0x9;
+	case SDLK_SEMICOLON:
+		return 0xE;
+	case SDLK_n:
+		return 0xA;
+	case SDLK_m:
+		return 0x0;
+	case SDLK_COMMA:
+		return 0xB;
+	case SDLK_PERIOD:
+		return 0xF;
+	default:
+		return CHIP8_KEY_NONE;
+	}
 }
 
-static void render_white(SDL_Renderer *renderer)
+/*
+ * Whether LD Vx, K is waiting or about to ask for a key. Skipping a wait to
+ * the end of a frame clears chip->key_wait, but leaves PC on the wait.
+ */
+static int wants_key(struct chip8 *chip)
 {
-	SDL_SetRenderDrawColor(renderer, 255, 255, 255, SDL_ALPHA_OPAQUE);
+	return chip->key_wait || (chip->pc + 2 < CHIP8_RAMBYTES
+		&& chip8_decoded_at(chip, chip->pc)->op == CHIP8_OP_LD_VX_K);
 }
 
-byte waitkey()
+/*
+ * Take the events that have come in, halting on a quit. A key pressed on
+ * the keypad is kept for LD Vx, K if it wants one.
+ */
+static void poll_events(struct chip8 *chip, int want_key)
 {
 	SDL_Event event;
-	byte keycode;
 
-	while (1) {
-		SDL_WaitEvent(&event);
-		if (event.type != SDL_KEYDOWN) {
-			continue;
+	while (SDL_PollEvent(&event)) {
+		if (event.type == SDL_QUIT) {
+			chip8_halt(chip);
+		} else if (event.type == SDL_KEYDOWN && want_key
+			&& key_pressed == CHIP8_KEY_NONE) {
+			key_pressed = key_from_sym(event.key.keysym.sym);
 		}
-		switch (event.key.keysym.sym) {
-		case SDLK_7:
-			keycode = 0x1;
-			break;
-		case SDLK_8:
-			keycode = 0x2;
-			break;
-		case SDLK_9:
-			keycode = 0x3;
-			break;
-		case SDLK_0:
-			keycode = 0xC;
-			break;
-		case SDLK_u:
-			keycode = 0x4;
-			break;
-		case SDLK_i:
-			keycode = 0x5;
-			break;
-		case SDLK_o:
-			keycode = 0x6;
-			break;
-		case SDLK_p:
-			keycode = 0xD;
-			break;
-		case SDLK_j:
-			keycode = 0x7;
-			break;
-		case SDLK_k:
-			keycode = 0x8;
-			break;
-		case SDLK_l:
-			keycode = 0x9;
-			break;
-		case SDLK_SEMICOLON:
-			keycode = 0xE;
-			break;
-		case SDLK_n:
-			keycode = 0xA;
-			break;
-		case SDLK_m:
-			keycode = 0x0;
-			break;
-		case SDLK_COMMA:
-			keycode = 0xB;
-			break;
-		case SDLK_PERIOD:
-			keycode = 0xF;
-			break;
-		default:
-			keycode = 0xFF;
-			break;
-		}
-		break;
 	}
+}
 
-	return keycode;
+/* Never blocks: whoever keeps the time calls again once a frame has passed */
+static byte waitkey(struct chip8 *chip)
+{
+	byte key;
+
+	poll_events(chip, 1);
+	key = key_pressed;
+	key_pressed = CHIP8_KEY_NONE;
+	return key;
 }
 
 struct audiodata {
@@ -235,13 +625,11 @@ static void populate_audio(void *data, Uint8 *stream, int len)
 	}
 }
 
-static void *timer_thread_update(void *arg)
+static void setup_audio(void)
 {
 	long freq = 770;
-	struct chip8 *chip = arg;
 	SDL_AudioSpec spec;
-	struct audiodata audiodata;
-	SDL_AudioStatus status;
+	static struct audiodata audiodata;
 
 	spec.freq = FREQUENCY;
 	spec.format = AUDIO_U8;
@@ -257,32 +645,46 @@ static void *timer_thread_update(void *arg)
 		fprintf(stderr, "Failed to open audio: %s\n", SDL_GetError());
 		exit(EXIT_FAILURE);
 	}
+}
 
-	while (!chip->is_halted) {
-		usleep(1000000 / 60); /* 60 Hz */
-		if (chip->reg_dt > 0) {
-			chip->reg_dt--;
-		}
-		if (chip->reg_st > 0) {
-			chip->reg_st--;
-		}
-		status = SDL_GetAudioStatus();
-		if (chip->reg_st > 0
-			&& (status == SDL_AUDIO_STOPPED
-				|| status == SDL_AUDIO_PAUSED)) {
-			SDL_PauseAudio(0);
-		} else if (chip->reg_st == 0 && status == SDL_AUDIO_PLAYING) {
-			SDL_PauseAudio(1);
-		}
+/*
+ * A frame's work, once however many frames have started since the last
+ * call: frames late, the timers are still ticked once for each of them
+ */
+static void wall_frame(struct chip8 *chip, unsigned long frames)
+{
+	SDL_AudioStatus status;
+
+	poll_events(chip, wants_key(chip));
+	wall_frames += frames;
+	if (!virtual_timers) {
+		chip8_tick(chip, frames);
+	}
+	if (!fast_forward) {
+		chip8_present(chip);
+	}
+	status = SDL_GetAudioStatus();
+	if (chip8_getst(chip) > 0
+		&& (status == SDL_AUDIO_STOPPED
+			|| status == SDL_AUDIO_PAUSED)) {
+		SDL_PauseAudio(0);
+	} else if (chip8_getst(chip) == 0 && status == SDL_AUDIO_PLAYING) {
+		SDL_PauseAudio(1);
+	}
+	if (rewind_buffer != NULL) {
+		rewind_frame(chip);
+	}
+	if (saver != NULL) {
+		checkpoint_frame(chip);
 	}
-	return NULL;
 }
 
-static int is_key_down(byte key)
+static int is_key_down(struct chip8 *chip, byte key)
 {
 	const Uint8 *state;
 	SDL_Scancode code;
 
+	(void) chip;
 	SDL_PumpEvents();
 	state = SDL_GetKeyboardState(NULL);
        
@@ -341,13 +743,225 @@ static int is_key_down(byte key)
 	return state[code];
 }
 
+/* Runs after every instruction: a slice ends every CLOCK_SLICE of them */
 static void check_kill(struct chip8 *chip)
 {
-	SDL_Event event;
-	SDL_PollEvent(&event);
-	if (event.type == SDL_QUIT) {
-		chip8_halt(chip);
+	static unsigned int slice = 0;
+	unsigned long frames;
+
+	if (chip->key_wait) {
+		/* LD Vx, K found no key: sleep, then it asks again */
+		slice = 0;
+		chip->idle_waits++;
+		idle_wait(chip);
+		chip->key_wait = 0;
+		return;
+	}
+	if (++slice < CLOCK_SLICE) {
+		return;
 	}
+	slice = 0;
+	frames = chip8_clock_poll(&frame_clock, 0);
+	if (frames > 0) {
+		wall_frame(chip, frames);
+	}
+}
+
+/* A wait loop has nothing to do until the next frame, so sleep until then */
+static void idle_wait(struct chip8 *chip)
+{
+	wall_frame(chip, chip8_clock_poll(&frame_clock, 1));
+}
+
+/* Once a frame: while Backspace is held, go back a frame instead */
+static void rewind_frame(struct chip8 *chip)
+{
+	const Uint8 *state = SDL_GetKeyboardState(NULL);
+
+	if (state[SDL_SCANCODE_BACKSPACE]) {
+		chip8_rewind_back(rewind_buffer, chip, 1);
+	} else if (chip8_rewind_capture(rewind_buffer, chip) < 0) {
+		fprintf(stderr, "Rewind buffer is too small for a frame\n");
+	}
+}
+
+/* Once a frame: save on F5 and every so often, load on F9 */
+static void checkpoint_frame(struct chip8 *chip)
+{
+	static int save_was_down = 0;
+	static int load_was_down = 0;
+	static unsigned long last_checkpoint = 0;
+	const Uint8 *state = SDL_GetKeyboardState(NULL);
+	int save_down = state[SDL_SCANCODE_F5];
+	int load_down = state[SDL_SCANCODE_F9];
+
+	if (load_down && !load_was_down) {
+		chip8_savestate_load(chip, state_file);
+	} else if ((save_down && !save_was_down)
+		|| wall_frames - last_checkpoint >= CHECKPOINT_FRAMES) {
+		chip8_saver_save(saver, chip, state_file);
+		last_checkpoint = wall_frames;
+	}
+	save_was_down = save_down;
+	load_was_down = load_down;
+}
+
+/* The frame that cycle count falls in, at the current frame length */
+static unsigned long frame_at(struct scheduler *sched, unsigned long cycles)
+{
+	return sched->base_frames + (cycles - sched->base_cycles) / sched->ipf;
+}
+
+/* From the frame now starting on, run ipf instructions a frame */
+static void set_ipf(struct scheduler *sched, unsigned int ipf)
+{
+	sched->base_cycles += (sched->frames - sched->base_frames)
+		* sched->ipf;
+	sched->base_frames = sched->frames;
+	sched->ipf = ipf;
+}
+
+/*
+ * Scale a frame down to a little less than the host managed last second,
+ * or, once it keeps up, grow it back toward target_ipf a step at a time
+ */
+static void adapt_ipf(struct scheduler *sched)
+{
+	unsigned long ipf = sched->ipf;
+
+	if (sched->window_clock > CHIP8_CLOCK_HZ) {
+		ipf = ipf * CHIP8_CLOCK_HZ / sched->window_clock;
+		ipf -= ipf / IPF_HEADROOM;
+		if (ipf == 0) {
+			ipf = 1;
+		}
+	} else if (ipf < sched->target_ipf) {
+		ipf += ipf / IPF_GROWTH + 1;
+		if (ipf > sched->target_ipf) {
+			ipf = sched->target_ipf;
+		}
+	}
+	if (ipf != sched->ipf) {
+		set_ipf(sched, ipf);
+	}
+}
+
+/* The kill check on virtual time: also the frame clock */
+static void schedule_check(struct chip8 *chip)
+{
+	struct scheduler *sched = &scheduler;
+	unsigned long frames;
+
+	/*
+	 * A rewind or a load can take the machine back to an earlier frame.
+	 * Before the last change of ipf, the frames start over from there.
+	 */
+	if (chip->cycles < sched->base_cycles) {
+		sched->base_frames = sched->frames;
+		sched->base_cycles = chip->cycles;
+		sched->window_start = sched->frames;
+		sched->window_clock = 0;
+	}
+	frames = frame_at(sched, chip->cycles);
+	if (sched->frames > frames) {
+		sched->frames = frames;
+		sched->window_start = frames;
+		sched->window_clock = 0;
+	}
+	while (sched->frames < frames) {
+		sched->frames++;
+		chip8_tick(chip, 1);
+		if (sched->input == NULL) {
+			/* The keys are read as they are */
+		} else if (sched->is_recording) {
+			chip8_input_record(sched->input, sched->frames,
+				sample_keys(chip));
+		} else {
+			chip8_input_frame(sched->input, sched->frames);
+		}
+		schedule_frame(chip);
+		frames = frame_at(sched, chip->cycles);
+	}
+	chip->idle_until = sched->base_cycles
+		+ (frames + 1 - sched->base_frames) * sched->ipf;
+}
+
+/*
+ * The end of a frame on virtual time: wait for the clock, or fast-forward.
+ * Every second's worth of frames, say so if they took longer than that,
+ * and size the frames to fit, or back toward target_ipf once they do.
+ */
+static void schedule_frame(struct chip8 *chip)
+{
+	struct scheduler *sched = &scheduler;
+	const Uint8 *state = SDL_GetKeyboardState(NULL);
+	unsigned int every = sched->present_every;
+	unsigned long frames;
+
+	if (every == 0 && state[SDL_SCANCODE_TAB]) {
+		every = TURBO_PRESENT_EVERY;
+	}
+	fast_forward = every > 0;
+	if (fast_forward) {
+		if (sched->frames % every == 0) {
+			chip8_present(chip);
+		}
+		sched->window_start = sched->frames;
+		sched->window_clock = 0;
+		frames = chip8_clock_poll(&frame_clock, 0);
+		if (frames > 0) {
+			wall_frame(chip, frames);
+		}
+		return;
+	}
+	/* Behind, e.g. after waiting on a key, missed frames are not made up */
+	frames = chip8_clock_poll(&frame_clock, 1);
+	if (frames == 0) {
+		/* The clock failed, and has said why; carry on unpaced */
+		wall_frame(chip, 0);
+		return;
+	}
+	sched->late += frames - 1;
+	sched->window_clock += frames;
+	if (sched->frames - sched->window_start >= CHIP8_CLOCK_HZ) {
+		if (sched->window_clock > CHIP8_CLOCK_HZ) {
+			fprintf(stderr, "Running behind: %d frames took "
+				"%.2f s (%.0f%% speed at %u instructions "
+				"a frame)\n", CHIP8_CLOCK_HZ,
+				(double) sched->window_clock / CHIP8_CLOCK_HZ,
+				100.0 * CHIP8_CLOCK_HZ / sched->window_clock,
+				sched->ipf);
+		}
+		if (sched->input == NULL) {
+			adapt_ipf(sched);
+		}
+		sched->window_start = sched->frames;
+		sched->window_clock = 0;
+	}
+	wall_frame(chip, frames);
+}
+
+static unsigned short sample_keys(struct chip8 *chip)
+{
+	unsigned short keys = 0;
+	byte key;
+	for (key = 0; key <= 0xF; key++) {
+		if (is_key_down(chip, key)) {
+			keys |= 1 << key;
+		}
+	}
+	return keys;
+}
+
+/*
+ * The lowest key latched this frame, or none. A key pressed during a wait
+ * is latched, and logged, at the start of a frame like any other, so the
+ * wait ends then, just as it will on replay.
+ */
+static byte record_waitkey(struct chip8 *chip)
+{
+	(void) chip;
+	return chip8_lowest_key(scheduler.input->keys);
 }
 
 static void teardown_display()
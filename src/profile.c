@@ -0,0 +1,283 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+/*
+ * The profiling engine: the table interpreter's loop with counters added,
+ * so the other engines pay nothing for them. Fused sequences are run one
+ * instruction at a time, so that every address is counted on its own. The
+ * report is written once the machine halts, either as folded stacks of
+ * opcode class and address, for flame graph tools, or as CSV.
+ *
+ * Only CALL and RET move the stack pointer, so a handler that raised it
+ * entered a subroutine and one that lowered it left one. The engine keeps
+ * a shadow stack of the routines being run from that alone. A CALL on a
+ * full stack or a RET on an empty one faults before moving it, and stops
+ * the machine with both stacks as they were.
+ */
+
+#include "profile.h"
+#include <stdlib.h>
+#include <string.h>
+
+void chip8_profile_init(struct chip8_profile *prof, const char *path)
+{
+	memset(prof, 0, sizeof(*prof));
+	prof->path = path;
+}
+
+static int compare_symbols(const void *a, const void *b)
+{
+	const struct chip8_symbol *sa = a;
+	const struct chip8_symbol *sb = b;
+	return (int) sa->addr - (int) sb->addr;
+}
+
+/* Read an "ADDRESS LABEL" map, as asm8 -m writes, to name addresses by */
+int chip8_profile_load_symbols(struct chip8_profile *prof, const char *path)
+{
+	char line[256];
+	char name[CHIP8_PROFILE_SYMBOLSIZE];
+	unsigned int addr;
+	struct chip8_symbol *sym;
+	FILE *fp = fopen(path, "r");
+
+	if (fp == NULL) {
+		perror(path);
+		return -1;
+	}
+	prof->num_symbols = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%x %63s", &addr, name) != 2
+			|| addr >= CHIP8_RAMBYTES) {
+			continue;
+		}
+		if (prof->num_symbols == CHIP8_PROFILE_SYMBOLS) {
+			fprintf(stderr, "%s: Too many symbols\n", path);
+			break;
+		}
+		sym = &prof->symbols[prof->num_symbols++];
+		sym->addr = addr;
+		strcpy(sym->name, name);
+	}
+	fclose(fp);
+	qsort(prof->symbols, prof->num_symbols, sizeof(prof->symbols[0]),
+		compare_symbols);
+	return 0;
+}
+
+/* The last symbol at or before addr, or NULL */
+static const struct chip8_symbol *find_symbol(struct chip8_profile *prof,
+	unsigned short addr)
+{
+	int lo = 0;
+	int hi = prof->num_symbols;
+	int mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (prof->symbols[mid].addr <= addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo > 0 ? &prof->symbols[lo - 1] : NULL;
+}
+
+/* Name addr as label or label+offset if there is a map, else in hex */
+static const char *addr_name(struct chip8_profile *prof, unsigned short addr,
+	char *buf, size_t size)
+{
+	const struct chip8_symbol *sym = find_symbol(prof, addr);
+
+	if (sym == NULL) {
+		snprintf(buf, size, "0x%03X", addr);
+	} else if (sym->addr == addr) {
+		snprintf(buf, size, "%s", sym->name);
+	} else {
+		snprintf(buf, size, "%s+%d", sym->name, addr - sym->addr);
+	}
+	return buf;
+}
+
+static void end_frame(struct chip8_profile *prof, struct chip8 *chip)
+{
+	unsigned long n = chip->cycles - prof->frame_start;
+	int bucket = 0;
+
+	while (n >> bucket && bucket < CHIP8_PROFILE_FRAME_BUCKETS - 1) {
+		bucket++;
+	}
+	prof->frame_buckets[bucket]++;
+	prof->frames++;
+	prof->frame_start = chip->cycles;
+}
+
+static void enter(struct chip8_profile *prof, unsigned short addr,
+	unsigned long now)
+{
+	struct chip8_profile_frame *frame;
+
+	if (prof->depth == CHIP8_PROFILE_DEPTH) {
+		return;
+	}
+	frame = &prof->shadow[prof->depth++];
+	frame->addr = addr;
+	frame->entry = now;
+	frame->children = 0;
+	prof->sub_calls[addr]++;
+	prof->sub_active[addr]++;
+}
+
+static void leave(struct chip8_profile *prof, unsigned long now)
+{
+	struct chip8_profile_frame *frame = &prof->shadow[--prof->depth];
+	unsigned long inclusive = now - frame->entry;
+
+	prof->sub_exclusive[frame->addr] += inclusive - frame->children;
+	if (--prof->sub_active[frame->addr] == 0) {
+		prof->sub_inclusive[frame->addr] += inclusive;
+	}
+	if (prof->depth > 0) {
+		prof->shadow[prof->depth - 1].children += inclusive;
+	}
+}
+
+/* Run from the current PC until halted, counting, then write the report */
+void chip8_exec_profiled(struct chip8 *chip)
+{
+	struct chip8_profile *prof = chip->profile;
+	struct chip8_decoded *d;
+	unsigned short sp;
+
+	prof->frame_start = chip->cycles;
+	enter(prof, chip->pc, chip->cycles);
+	while (chip->pc + 2 < CHIP8_RAMBYTES && !chip->is_halted) {
+		prof->pc_counts[chip->pc]++;
+		sp = chip->sp;
+		d = chip8_fetch(chip);
+		prof->op_counts[d->op]++;
+		if (d->handler(chip, d->ins) != 0) {
+			break;
+		}
+		chip->cycles++;
+		/* A CALL counts toward the caller, a RET the callee */
+		if (chip->sp > sp) {
+			enter(prof, chip->pc, chip->cycles);
+		} else if (chip->sp < sp && prof->depth > 1) {
+			leave(prof, chip->cycles);
+		}
+		if (chip->frame_pending) {
+			end_frame(prof, chip);
+			chip8_present(chip);
+		}
+		chip->check_kill(chip);
+	}
+	chip8_halt(chip);
+	while (prof->depth > 0) {
+		leave(prof, chip->cycles);
+	}
+	if (prof->path != NULL) {
+		chip8_profile_save(prof, chip);
+	}
+}
+
+/* One "op;address count" line per address that ran */
+void chip8_profile_write_folded(struct chip8_profile *prof,
+	struct chip8 *chip, FILE *fp)
+{
+	char name[CHIP8_PROFILE_SYMBOLSIZE + 16];
+	int addr;
+
+	for (addr = 0; addr < CHIP8_RAMBYTES; addr++) {
+		if (prof->pc_counts[addr] > 0) {
+			fprintf(fp, "%s;%s %lu\n",
+				chip8_op_names[chip->icache[addr].op],
+				addr_name(prof, addr, name, sizeof(name)),
+				prof->pc_counts[addr]);
+		}
+	}
+}
+
+/*
+ * "kind,key,count" rows: executions per address, then per opcode class,
+ * then the number of frames that ran each range of instruction counts,
+ * then calls and inclusive and exclusive instructions per subroutine
+ */
+void chip8_profile_write_csv(struct chip8_profile *prof, struct chip8 *chip,
+	FILE *fp)
+{
+	char name[CHIP8_PROFILE_SYMBOLSIZE + 16];
+	int addr;
+	int i;
+
+	(void) chip;
+	fprintf(fp, "kind,key,count\n");
+	for (addr = 0; addr < CHIP8_RAMBYTES; addr++) {
+		if (prof->pc_counts[addr] > 0) {
+			fprintf(fp, "pc,%s,%lu\n",
+				addr_name(prof, addr, name, sizeof(name)),
+				prof->pc_counts[addr]);
+		}
+	}
+	for (i = 0; i < CHIP8_OP_COUNT; i++) {
+		if (prof->op_counts[i] > 0) {
+			fprintf(fp, "op,%s,%lu\n", chip8_op_names[i],
+				prof->op_counts[i]);
+		}
+	}
+	for (i = 0; i < CHIP8_PROFILE_FRAME_BUCKETS; i++) {
+		if (prof->frame_buckets[i] == 0) {
+			continue;
+		}
+		if (i == 0) {
+			fprintf(fp, "frame,0,%lu\n", prof->frame_buckets[i]);
+		} else if (i == CHIP8_PROFILE_FRAME_BUCKETS - 1) {
+			fprintf(fp, "frame,%lu+,%lu\n", 1UL << (i - 1),
+				prof->frame_buckets[i]);
+		} else {
+			fprintf(fp, "frame,%lu-%lu,%lu\n", 1UL << (i - 1),
+				(1UL << i) - 1, prof->frame_buckets[i]);
+		}
+	}
+	for (addr = 0; addr < CHIP8_RAMBYTES; addr++) {
+		if (prof->sub_calls[addr] == 0) {
+			continue;
+		}
+		addr_name(prof, addr, name, sizeof(name));
+		fprintf(fp, "calls,%s,%lu\n", name, prof->sub_calls[addr]);
+		fprintf(fp, "inclusive,%s,%lu\n", name,
+			prof->sub_inclusive[addr]);
+		fprintf(fp, "exclusive,%s,%lu\n", name,
+			prof->sub_exclusive[addr]);
+	}
+}
+
+/* Write the report to prof->path: CSV if it ends in .csv, else folded */
+int chip8_profile_save(struct chip8_profile *prof, struct chip8 *chip)
+{
+	size_t len = strlen(prof->path);
+	FILE *fp = fopen(prof->path, "w");
+
+	if (fp == NULL) {
+		perror(prof->path);
+		return -1;
+	}
+	if (len >= 4 && strcmp(prof->path + len - 4, ".csv") == 0) {
+		chip8_profile_write_csv(prof, chip, fp);
+	} else {
+		chip8_profile_write_folded(prof, chip, fp);
+	}
+	if (fclose(fp) != 0) {
+		perror(prof->path);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include "chip8.h"
+#include "dispatch.h"
+
+/* Frames are counted by how many instructions ran, in powers of two */
+#define CHIP8_PROFILE_FRAME_BUCKETS 32
+/*
+ * The program itself, then one frame per return address on the stack,
+ * which holds CHIP8_STACKSIZE - 1 of them
+ */
+#define CHIP8_PROFILE_DEPTH CHIP8_STACKSIZE
+#define CHIP8_PROFILE_SYMBOLS 256
+#define CHIP8_PROFILE_SYMBOLSIZE 64
+
+/* A subroutine being run, as mirrored from CALL and RET */
+struct chip8_profile_frame {
+	unsigned short addr;
+	unsigned long entry; /* Cycle count just after the CALL */
+	unsigned long children; /* Instructions run by the routines it called */
+};
+
+/* A label from an asm8 map, which addresses are reported by */
+struct chip8_symbol {
+	unsigned short addr;
+	char name[CHIP8_PROFILE_SYMBOLSIZE];
+};
+
+/*
+ * Exact execution counts, kept by the profiling engine only; the other
+ * engines never look at them
+ */
+struct chip8_profile {
+	const char *path; /* Where the report goes when the machine halts */
+	unsigned long pc_counts[CHIP8_RAMBYTES];
+	unsigned long op_counts[CHIP8_OP_COUNT];
+	unsigned long frame_buckets[CHIP8_PROFILE_FRAME_BUCKETS];
+	unsigned long frames;
+	unsigned long frame_start; /* Cycle count the current frame began at */
+
+	/*
+	 * Per subroutine entry address, and the address the program started
+	 * at for the program itself. Inclusive counts take in the routines it
+	 * called; a recursive routine is counted once, by its outermost call.
+	 */
+	unsigned long sub_calls[CHIP8_RAMBYTES];
+	unsigned long sub_inclusive[CHIP8_RAMBYTES];
+	unsigned long sub_exclusive[CHIP8_RAMBYTES];
+	unsigned short sub_active[CHIP8_RAMBYTES];
+	struct chip8_profile_frame shadow[CHIP8_PROFILE_DEPTH];
+	int depth;
+
+	struct chip8_symbol symbols[CHIP8_PROFILE_SYMBOLS]; /* By address */
+	int num_symbols;
+};
+
+void chip8_profile_init(struct chip8_profile *prof, const char *path);
+int chip8_profile_load_symbols(struct chip8_profile *prof, const char *path);
+void chip8_exec_profiled(struct chip8 *chip);
+void chip8_profile_write_folded(struct chip8_profile *prof,
+	struct chip8 *chip, FILE *fp);
+void chip8_profile_write_csv(struct chip8_profile *prof, struct chip8 *chip,
+	FILE *fp);
+int chip8_profile_save(struct chip8_profile *prof, struct chip8 *chip);
+
+#endif /* PROFILE_H */
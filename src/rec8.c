@@ -0,0 +1,34 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "recompile.h"
+
+int main(int argc, char *argv[])
+{
+	FILE *fp;
+	char *file_name;
+	int ret;
+
+	if (argc < 2) {
+		fp = stdin;
+	} else {
+		file_name = argv[1];
+		fp = fopen(file_name, "rb");
+		if (!fp) {
+			perror(file_name);
+			exit(EXIT_FAILURE);
+		}
+	}
+	ret = recompile(fp, stdout);
+	fclose(fp);
+	return ret < 0 ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,514 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+/*
+ * Static recompiler: follows every control flow path from the program start,
+ * splits the reachable code into basic blocks and writes out a C function
+ * with one label per block. Arithmetic is emitted as plain C; everything else
+ * calls the handler from instructions.c. RET and Bnnn go through a switch on
+ * PC, and jumps to anything that was not recovered (or code that the program
+ * overwrites) hand the rest of the run to the interpreter.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "recompile.h"
+
+#define X(ins) (((ins) & 0x0F00) >> 8)
+#define Y(ins) (((ins) & 0x00F0) >> 4)
+#define KK(ins) ((ins) & 0x00FF)
+#define ADDR(ins) ((ins) & 0x0FFF)
+
+enum flow {
+	FLOW_NEXT,	/* falls through to the next instruction */
+	FLOW_STORE,	/* falls through, but may have written code */
+	FLOW_JUMP,	/* JP addr */
+	FLOW_CALL,	/* CALL addr, returns to the next instruction */
+	FLOW_SKIP,	/* continues at +2 or +4 */
+	FLOW_DYNAMIC,	/* RET and JP V0, addr */
+	FLOW_WAIT,	/* LD Vx, K, which runs again until a key comes */
+	FLOW_EXIT
+};
+
+static int in_rom(struct recompiler *rc, unsigned int addr)
+{
+	return addr >= CHIP8_PROGSTART
+		&& addr + 2 <= CHIP8_PROGSTART + rc->size
+		&& addr + 2 < CHIP8_RAMBYTES;
+}
+
+static instruction fetch(struct recompiler *rc, unsigned short addr)
+{
+	size_t off = addr - CHIP8_PROGSTART;
+	return rc->rom[off] << 8 | rc->rom[off + 1];
+}
+
+static enum flow classify(instruction ins)
+{
+	switch ((ins & 0xF000) >> 12) {
+	case 0x0:
+		if (ins == 0x00EE) {
+			return FLOW_DYNAMIC;
+		} else if (ins == 0x00FD) {
+			return FLOW_EXIT;
+		}
+		return FLOW_NEXT;
+	case 0x1:
+		return FLOW_JUMP;
+	case 0x2:
+		return FLOW_CALL;
+	case 0x3:
+	case 0x4:
+	case 0x5:
+	case 0x9:
+		return FLOW_SKIP;
+	case 0xB:
+		return FLOW_DYNAMIC;
+	case 0xE:
+		if (KK(ins) == 0x9E || KK(ins) == 0xA1) {
+			return FLOW_SKIP;
+		}
+		return FLOW_NEXT;
+	case 0xF:
+		if (KK(ins) == 0x33 || KK(ins) == 0x55) {
+			return FLOW_STORE;
+		} else if (KK(ins) == 0x0A) {
+			return FLOW_WAIT;
+		}
+		return FLOW_NEXT;
+	default:
+		return FLOW_NEXT;
+	}
+}
+
+static void add_leader(struct recompiler *rc, unsigned short *work,
+	int *num_work, unsigned int addr)
+{
+	if (addr < CHIP8_RAMBYTES && !rc->leader[addr]) {
+		rc->leader[addr] = 1;
+		work[(*num_work)++] = addr;
+	}
+}
+
+static void find_blocks(struct recompiler *rc)
+{
+	unsigned short work[CHIP8_RAMBYTES];
+	int num_work = 0;
+	unsigned short addr;
+	instruction ins;
+	enum flow flow;
+
+	add_leader(rc, work, &num_work, CHIP8_PROGSTART);
+	while (num_work > 0) {
+		addr = work[--num_work];
+		while (in_rom(rc, addr) && !rc->reachable[addr]) {
+			rc->reachable[addr] = 1;
+			ins = fetch(rc, addr);
+			flow = classify(ins);
+			if (flow == FLOW_JUMP) {
+				add_leader(rc, work, &num_work, ADDR(ins));
+				break;
+			} else if (flow == FLOW_CALL) {
+				add_leader(rc, work, &num_work, ADDR(ins));
+				add_leader(rc, work, &num_work, addr + 2);
+				break;
+			} else if (flow == FLOW_SKIP) {
+				add_leader(rc, work, &num_work, addr + 2);
+				add_leader(rc, work, &num_work, addr + 4);
+				break;
+			} else if (flow == FLOW_WAIT) {
+				add_leader(rc, work, &num_work, addr);
+				add_leader(rc, work, &num_work, addr + 2);
+				break;
+			} else if (flow == FLOW_DYNAMIC || flow == FLOW_EXIT) {
+				break;
+			}
+			addr += 2;
+		}
+	}
+}
+
+static int is_block(struct recompiler *rc, unsigned int addr)
+{
+	return addr < CHIP8_RAMBYTES && rc->leader[addr]
+		&& rc->reachable[addr];
+}
+
+/* Continue at addr, which chip->pc already holds */
+static void emit_goto(struct recompiler *rc, FILE *fp, unsigned int addr,
+	const char *indent)
+{
+	if (is_block(rc, addr)) {
+		fprintf(fp, "%sgoto L_%03X;\n", indent, addr);
+	} else {
+		fprintf(fp, "%sgoto dispatch;\n", indent);
+	}
+}
+
+static void emit_handler(FILE *fp, const char *handler, instruction ins)
+{
+	fprintf(fp, "\tif (%s(chip, 0x%04X) != 0) {\n", handler, ins);
+	fprintf(fp, "\t\treturn;\n");
+	fprintf(fp, "\t}\n");
+}
+
+static const char *handler_name(instruction ins)
+{
+	switch ((ins & 0xF000) >> 12) {
+	case 0x0:
+		if (ins == 0x00E0) {
+			return "chip8_cls";
+		} else if (ins == 0x00EE) {
+			return "chip8_ret";
+		}
+		return "chip8_unknown";
+	case 0x2:
+		return "chip8_call";
+	case 0x8:
+		return "chip8_invalid";
+	case 0xB:
+		return "chip8_jump_add";
+	case 0xC:
+		return "chip8_rnd";
+	case 0xD:
+		return "chip8_draw";
+	case 0xE:
+		if (KK(ins) == 0x9E) {
+			return "chip8_skp";
+		} else if (KK(ins) == 0xA1) {
+			return "chip8_sknp";
+		}
+		return "chip8_invalid";
+	case 0xF:
+		switch (KK(ins)) {
+		case 0x07:
+			return "chip8_load_from_dt";
+		case 0x0A:
+			return "chip8_waitkey";
+		case 0x15:
+			return "chip8_load_dt";
+		case 0x18:
+			return "chip8_load_st";
+		case 0x29:
+			return "chip8_load_i_hexfont";
+		case 0x33:
+			return "chip8_store_bcd";
+		case 0x55:
+			return "chip8_store_range_from_i";
+		case 0x65:
+			return "chip8_load_range_from_i";
+		default:
+			return "chip8_unknown";
+		}
+	default:
+		return NULL;
+	}
+}
+
+/* Register arithmetic, written to match instructions.c exactly */
+static int emit_alu(FILE *fp, instruction ins)
+{
+	byte x = X(ins);
+	byte y = Y(ins);
+
+	switch ((ins & 0xF000) >> 12) {
+	case 0x6:
+		fprintf(fp, "\tv[0x%X] = 0x%02X;\n", x, KK(ins));
+		return 1;
+	case 0x7:
+		fprintf(fp, "\tv[0x%X] += 0x%02X;\n", x, KK(ins));
+		return 1;
+	case 0xA:
+		fprintf(fp, "\tchip->reg_i = 0x%03X;\n", ADDR(ins));
+		return 1;
+	case 0x8:
+		break;
+	default:
+		return 0;
+	}
+
+	if (x == y && ((ins & 0x000F) == 0x5 || (ins & 0x000F) == 0x7)) {
+		/* Subtracting a register from itself */
+		fprintf(fp, "\tv[0xF] = 0x0;\n");
+		fprintf(fp, "\tv[0x%X] = 0x0;\n", x);
+		return 1;
+	}
+
+	switch (ins & 0x000F) {
+	case 0x0:
+		fprintf(fp, "\tv[0x%X] = v[0x%X];\n", x, y);
+		break;
+	case 0x1:
+		fprintf(fp, "\tv[0x%X] |= v[0x%X];\n", x, y);
+		break;
+	case 0x2:
+		fprintf(fp, "\tv[0x%X] &= v[0x%X];\n", x, y);
+		break;
+	case 0x4:
+		fprintf(fp, "\tt = v[0x%X] + v[0x%X];\n", x, y);
+		fprintf(fp, "\tv[0xF] = t > 0xFF;\n");
+		fprintf(fp, "\tv[0x%X] = t;\n", x);
+		break;
+	case 0x5:
+		fprintf(fp, "\tv[0xF] = v[0x%X] > v[0x%X];\n", x, y);
+		fprintf(fp, "\tv[0x%X] = v[0x%X] - v[0x%X];\n", x, x, y);
+		break;
+	case 0x6:
+		fprintf(fp, "\tv[0xF] = v[0x%X] & 0x1;\n", x);
+		fprintf(fp, "\tv[0x%X] = v[0x%X] >> 1;\n", x, x);
+		break;
+	case 0x7:
+		fprintf(fp, "\tv[0xF] = v[0x%X] > v[0x%X];\n", y, x);
+		fprintf(fp, "\tv[0x%X] = v[0x%X] - v[0x%X];\n", x, y, x);
+		break;
+	case 0xE:
+		fprintf(fp, "\tv[0xF] = v[0x%X] & 0x1;\n", x);
+		fprintf(fp, "\tv[0x%X] = v[0x%X] << 1;\n", x, x);
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+static void emit_skip_test(FILE *fp, instruction ins)
+{
+	int equal = (ins & 0xF000) == 0x3000 || (ins & 0xF000) == 0x5000;
+	const char *cmp = equal ? "==" : "!=";
+	if (X(ins) == Y(ins) && ((ins & 0xF000) == 0x5000
+		|| (ins & 0xF000) == 0x9000)) {
+		/* Comparing a register with itself */
+		if (equal) {
+			fprintf(fp, "\tchip->pc += 2;\n");
+		}
+		return;
+	} else if ((ins & 0xF000) == 0x3000 || (ins & 0xF000) == 0x4000) {
+		fprintf(fp, "\tif (v[0x%X] %s 0x%02X) {\n", X(ins), cmp,
+			KK(ins));
+	} else {
+		fprintf(fp, "\tif (v[0x%X] %s v[0x%X]) {\n", X(ins), cmp,
+			Y(ins));
+	}
+	fprintf(fp, "\t\tchip->pc += 2;\n");
+	fprintf(fp, "\t}\n");
+}
+
+/* Emit one instruction; returns non-zero if it ends the block */
+static int emit_instruction(struct recompiler *rc, FILE *fp,
+	unsigned short addr)
+{
+	instruction ins = fetch(rc, addr);
+	enum flow flow = classify(ins);
+	const char *handler = handler_name(ins);
+
+	fprintf(fp, "\t/* 0x%03X: %04X */\n", addr, ins);
+	fprintf(fp, "\tchip->pc = 0x%03X;\n", addr + 2);
+	switch (flow) {
+	case FLOW_EXIT:
+		fprintf(fp, "\treturn;\n");
+		return 1;
+	case FLOW_JUMP:
+		fprintf(fp, "\tchip->pc = 0x%03X;\n", ADDR(ins));
+		fprintf(fp, "\tSTEP();\n");
+		emit_goto(rc, fp, ADDR(ins), "\t");
+		return 1;
+	case FLOW_CALL:
+		emit_handler(fp, handler, ins);
+		fprintf(fp, "\tSTEP();\n");
+		emit_goto(rc, fp, ADDR(ins), "\t");
+		return 1;
+	case FLOW_DYNAMIC:
+		emit_handler(fp, handler, ins);
+		fprintf(fp, "\tSTEP();\n");
+		fprintf(fp, "\tgoto dispatch;\n");
+		return 1;
+	case FLOW_SKIP:
+		if (handler != NULL) {
+			emit_handler(fp, handler, ins);
+		} else {
+			emit_skip_test(fp, ins);
+		}
+		fprintf(fp, "\tSTEP();\n");
+		fprintf(fp, "\tif (chip->pc == 0x%03X) {\n", addr + 4);
+		emit_goto(rc, fp, addr + 4, "\t\t");
+		fprintf(fp, "\t}\n");
+		emit_goto(rc, fp, addr + 2, "\t");
+		return 1;
+	case FLOW_WAIT:
+		emit_handler(fp, handler, ins);
+		fprintf(fp, "\tSTEP();\n");
+		fprintf(fp, "\tif (chip->pc == 0x%03X) {\n", addr);
+		emit_goto(rc, fp, addr, "\t\t");
+		fprintf(fp, "\t}\n");
+		emit_goto(rc, fp, addr + 2, "\t");
+		return 1;
+	case FLOW_STORE:
+		emit_handler(fp, handler, ins);
+		fprintf(fp, "\tSTEP();\n");
+		fprintf(fp, "\tif (code_modified(chip)) {\n");
+		fprintf(fp, "\t\tgoto interpret;\n");
+		fprintf(fp, "\t}\n");
+		return 0;
+	default:
+		if (ins == 0x0000) {
+			/* NOP */
+		} else if (!emit_alu(fp, ins)) {
+			emit_handler(fp, handler, ins);
+		}
+		fprintf(fp, "\tSTEP();\n");
+		return 0;
+	}
+}
+
+static void emit_bytes(FILE *fp, const char *name, const byte *bytes,
+	size_t len)
+{
+	size_t i;
+	fprintf(fp, "static const byte %s[ROM_SIZE] = {", name);
+	for (i = 0; i < len; i++) {
+		fprintf(fp, "%s0x%02X%s", i % 12 == 0 ? "\n\t" : "",
+			bytes[i], i + 1 < len ? ", " : "\n");
+	}
+	fprintf(fp, "};\n\n");
+}
+
+/* Stores bail out to the interpreter once they overwrite recompiled code */
+static void emit_code_check(FILE *fp, const byte *code, size_t len)
+{
+	emit_bytes(fp, "code", code, len);
+	fprintf(fp, "/* Did the last store to [I] overwrite "
+		"recompiled code? */\n");
+	fprintf(fp, "static int code_modified(struct chip8 *chip)\n{\n");
+	fprintf(fp, "\tunsigned int addr;\n");
+	fprintf(fp, "\tunsigned int off;\n");
+	fprintf(fp, "\tfor (addr = chip->reg_i; "
+		"addr < chip->reg_i + CHIP8_REGCOUNT; addr++) {\n");
+	fprintf(fp, "\t\toff = addr - CHIP8_PROGSTART;\n");
+	fprintf(fp, "\t\tif (addr >= CHIP8_PROGSTART && off < ROM_SIZE\n");
+	fprintf(fp, "\t\t\t&& code[off] && chip->ram[addr] != rom[off]) {\n");
+	fprintf(fp, "\t\t\treturn 1;\n");
+	fprintf(fp, "\t\t}\n");
+	fprintf(fp, "\t}\n");
+	fprintf(fp, "\treturn 0;\n");
+	fprintf(fp, "}\n\n");
+}
+
+static void emit_prologue(struct recompiler *rc, FILE *fp)
+{
+	byte code[REC8_MAXROM];
+	unsigned int addr;
+	int has_store = 0;
+
+	memset(code, 0, sizeof(code));
+	for (addr = CHIP8_PROGSTART; addr < CHIP8_RAMBYTES; addr++) {
+		if (rc->reachable[addr]) {
+			code[addr - CHIP8_PROGSTART] = 1;
+			code[addr - CHIP8_PROGSTART + 1] = 1;
+			if (classify(fetch(rc, addr)) == FLOW_STORE) {
+				has_store = 1;
+			}
+		}
+	}
+
+	fprintf(fp, "/* Generated by rec8, do not edit */\n\n");
+	fprintf(fp, "#include <stdio.h>\n");
+	fprintf(fp, "#include <string.h>\n");
+	fprintf(fp, "#include \"chip8.h\"\n");
+	fprintf(fp, "#include \"instructions.h\"\n");
+	fprintf(fp, "#include \"aot.h\"\n\n");
+	fprintf(fp, "#define ROM_SIZE %lu\n\n", (unsigned long) rc->size);
+	fprintf(fp, "#define STEP() do { \\\n");
+	fprintf(fp, "\tchip->cycles++; \\\n");
+	fprintf(fp, "\tif (chip->frame_pending) { \\\n");
+	fprintf(fp, "\t\tchip8_present(chip); \\\n");
+	fprintf(fp, "\t} \\\n");
+	fprintf(fp, "\tchip->check_kill(chip); \\\n");
+	fprintf(fp, "\tif (chip->is_halted) { \\\n");
+	fprintf(fp, "\t\treturn; \\\n");
+	fprintf(fp, "\t} \\\n");
+	fprintf(fp, "} while (0)\n\n");
+	emit_bytes(fp, "rom", rc->rom, rc->size);
+	if (has_store) {
+		emit_code_check(fp, code, rc->size);
+	}
+	fprintf(fp, "void chip8_exec_aot(struct chip8 *chip)\n{\n");
+	fprintf(fp, "\tbyte *v = chip->reg_v;\n");
+	fprintf(fp, "\tunsigned int t;\n\n");
+	fprintf(fp, "\t(void) t;\n");
+	fprintf(fp, "\tif (memcmp(chip->ram + CHIP8_PROGSTART, rom, ROM_SIZE)"
+		" != 0) {\n");
+	fprintf(fp, "\t\tfprintf(stderr, \"Loaded ROM does not match the "
+		"recompiled one\\n\");\n");
+	fprintf(fp, "\t\tgoto interpret;\n");
+	fprintf(fp, "\t}\n");
+	fprintf(fp, "\tgoto dispatch;\n");
+}
+
+static void emit_blocks(struct recompiler *rc, FILE *fp)
+{
+	unsigned int start;
+	unsigned int addr;
+
+	for (start = CHIP8_PROGSTART; start < CHIP8_RAMBYTES; start++) {
+		if (!is_block(rc, start)) {
+			continue;
+		}
+		fprintf(fp, "\nL_%03X:\n", start);
+		addr = start;
+		while (!emit_instruction(rc, fp, addr)) {
+			addr += 2;
+			if (!in_rom(rc, addr) || rc->leader[addr]) {
+				emit_goto(rc, fp, addr, "\t");
+				break;
+			}
+		}
+	}
+}
+
+static void emit_epilogue(struct recompiler *rc, FILE *fp)
+{
+	unsigned int addr;
+
+	fprintf(fp, "\ndispatch:\n");
+	fprintf(fp, "\tswitch (chip->pc) {\n");
+	for (addr = CHIP8_PROGSTART; addr < CHIP8_RAMBYTES; addr++) {
+		if (is_block(rc, addr)) {
+			fprintf(fp, "\tcase 0x%03X:\n", addr);
+			fprintf(fp, "\t\tgoto L_%03X;\n", addr);
+		}
+	}
+	fprintf(fp, "\tdefault:\n");
+	fprintf(fp, "\t\tgoto interpret;\n");
+	fprintf(fp, "\t}\n");
+	fprintf(fp, "\ninterpret:\n");
+	fprintf(fp, "\tchip8_interpret(chip);\n");
+	fprintf(fp, "}\n");
+}
+
+int recompile(FILE *in_fp, FILE *out_fp)
+{
+	static struct recompiler rc;
+
+	memset(&rc, 0, sizeof(rc));
+	rc.size = fread(rc.rom, 1, REC8_MAXROM, in_fp);
+	if (rc.size == 0) {
+		fprintf(stderr, "Empty program\n");
+		return -1;
+	}
+	if (fgetc(in_fp) != EOF) {
+		fprintf(stderr, "Program is too long\n");
+		return -1;
+	}
+	find_blocks(&rc);
+	emit_prologue(&rc, out_fp);
+	emit_blocks(&rc, out_fp);
+	emit_epilogue(&rc, out_fp);
+	return 0;
+}
@@ -0,0 +1,30 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#ifndef RECOMPILE_H
+#define RECOMPILE_H
+
+#include <stdio.h>
+#include "chip8.h"
+
+#define REC8_MAXROM (CHIP8_RAMBYTES - CHIP8_PROGSTART)
+
+typedef unsigned short instruction;
+
+struct recompiler {
+	byte rom[REC8_MAXROM];
+	size_t size;
+	byte reachable[CHIP8_RAMBYTES];
+	byte leader[CHIP8_RAMBYTES];
+};
+
+int recompile(FILE *in_fp, FILE *out_fp);
+
+#endif /* RECOMPILE_H */
@@ -0,0 +1,392 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+/*
+ * Rewind buffer: one state per frame in a fixed amount of memory. Every
+ * so often a frame is stored whole, as a keyframe; the frames after it are
+ * stored as the XOR of their state with the keyframe's, and consecutive
+ * frames differ in so few bytes that a delta is mostly a few short runs.
+ * Taking the keyframe with chip8_snapshot makes the machine track the RAM
+ * pages it writes, so a delta only has to look at the registers, the
+ * display and those pages.
+ *
+ * A record is a list of runs, each a 16-bit count of bytes to skip, a
+ * 16-bit length and that many bytes to XOR into a struct chip8_snapshot;
+ * a keyframe is XORed into one that is all zero. Records are written one
+ * after another into a ring of bytes, and the oldest keyframe goes, with
+ * its deltas, when a new record does not fit.
+ */
+
+#include "rewind.h"
+#include "snapshot.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ALL_PAGES ((uint32_t) ((1ULL << CHIP8_PAGES) - 1))
+#define RAM_OFFSET offsetof(struct chip8_snapshot, ram)
+/* Runs closer than a run header are cheaper to store as one */
+#define MERGE_GAP 4
+/* Worst case: a run header for every byte that is stored */
+#define MAX_RECORD (2 * sizeof(struct chip8_snapshot) + 64)
+
+#define FIELD(f) { offsetof(struct chip8_snapshot, f), \
+	offsetof(struct chip8, f), sizeof(((struct chip8 *) NULL)->f) }
+
+/* A field of struct chip8 and where it lives in struct chip8_snapshot */
+struct field {
+	size_t snap;
+	size_t chip;
+	size_t size;
+};
+
+/* In the order of struct chip8_snapshot, which RAM comes last in */
+static const struct field fields[] = {
+	FIELD(reg_v), FIELD(reg_i), FIELD(pc), FIELD(sp), FIELD(ticks),
+	FIELD(dt_expiry), FIELD(st_expiry), FIELD(stack), FIELD(rand_state),
+	FIELD(is_halted), FIELD(fault), FIELD(key_wait), FIELD(cycles),
+	FIELD(display)
+};
+
+static const byte zero[sizeof(struct chip8_snapshot)];
+
+struct entry {
+	size_t offset;
+	size_t size;
+	int is_key;
+};
+
+struct chip8_rewind {
+	byte *buf;
+	size_t budget;
+	size_t head; /* Where the next record goes */
+	size_t used;
+	struct entry *entries; /* Oldest first, from entries[first] round */
+	size_t capacity;
+	size_t first;
+	size_t count;
+	unsigned int interval;
+	unsigned int since_key; /* Deltas stored since the newest keyframe */
+	struct chip8_snapshot key; /* The newest keyframe */
+	struct chip8_snapshot work;
+	byte *encoded;
+};
+
+struct encoder {
+	byte *out;
+	size_t len;
+	size_t end; /* Just past the last run, as an offset into a snapshot */
+};
+
+#define ENTRY(rw, i) (&(rw)->entries[((rw)->first + (i)) % (rw)->capacity])
+
+static uint64_t load64(const byte *p)
+{
+	uint64_t word;
+	memcpy(&word, p, sizeof(word));
+	return word;
+}
+
+static void emit(struct encoder *e, size_t offset, const byte *now,
+	const byte *base, size_t len)
+{
+	uint16_t skip = offset - e->end;
+	uint16_t count = len;
+	size_t i;
+
+	memcpy(e->out + e->len, &skip, 2);
+	memcpy(e->out + e->len + 2, &count, 2);
+	e->len += 4;
+	for (i = 0; i < len; i++) {
+		e->out[e->len++] = now[i] ^ base[i];
+	}
+	e->end = offset + len;
+}
+
+/* Add runs for the bytes of now that differ from base, at offset */
+static void encode(struct encoder *e, size_t offset, const byte *now,
+	const byte *base, size_t size)
+{
+	size_t start;
+	size_t gap;
+	size_t i = 0;
+
+	while (i < size) {
+		while (i + 8 <= size && load64(now + i) == load64(base + i)) {
+			i += 8;
+		}
+		while (i < size && now[i] == base[i]) {
+			i++;
+		}
+		if (i == size) {
+			break;
+		}
+		start = i;
+		for (gap = 0; i < size && gap < MERGE_GAP; i++) {
+			gap = now[i] == base[i] ? gap + 1 : 0;
+		}
+		emit(e, offset + start, now + start, base + start,
+			i - gap - start);
+	}
+}
+
+/* XOR a record into snap; returns the RAM pages it changed */
+static uint32_t apply(struct chip8_snapshot *snap, const byte *rec,
+	size_t size)
+{
+	byte *p = (byte *) snap;
+	uint32_t pages = 0;
+	uint16_t skip;
+	uint16_t len;
+	size_t offset = 0;
+	size_t first, last;
+	size_t i = 0;
+	size_t j;
+
+	while (i < size) {
+		memcpy(&skip, rec + i, 2);
+		memcpy(&len, rec + i + 2, 2);
+		i += 4;
+		offset += skip;
+		for (j = 0; j < len; j++) {
+			p[offset + j] ^= rec[i + j];
+		}
+		if (offset + len > RAM_OFFSET) {
+			first = offset > RAM_OFFSET ? offset - RAM_OFFSET : 0;
+			last = offset + len - 1 - RAM_OFFSET;
+			for (j = first / CHIP8_PAGEBYTES;
+				j <= last / CHIP8_PAGEBYTES; j++) {
+				pages |= (uint32_t) 1 << j;
+			}
+		}
+		offset += len;
+		i += len;
+	}
+	return pages;
+}
+
+/* Snapshot the machine as the new keyframe and encode it */
+static size_t encode_key(struct chip8_rewind *rw, struct chip8 *chip)
+{
+	struct encoder e = { rw->encoded, 0, 0 };
+
+	memset(&rw->key, 0, sizeof(rw->key));
+	chip8_snapshot(chip, &rw->key);
+	encode(&e, 0, (byte *) &rw->key, zero, sizeof(rw->key));
+	return e.len;
+}
+
+static size_t encode_delta(struct chip8_rewind *rw, struct chip8 *chip)
+{
+	struct encoder e = { rw->encoded, 0, 0 };
+	byte *key = (byte *) &rw->key;
+	uint32_t pages = chip->dirty_pages;
+	size_t addr;
+	size_t i;
+
+	/* Somebody else restored or took a snapshot since the keyframe */
+	if (chip->snapshot_serial != rw->key.serial) {
+		pages = ALL_PAGES;
+	}
+	for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		encode(&e, fields[i].snap, (byte *) chip + fields[i].chip,
+			key + fields[i].snap, fields[i].size);
+	}
+	for (i = 0; i < CHIP8_PAGES; i++) {
+		if (pages >> i & 0x1) {
+			addr = i * CHIP8_PAGEBYTES;
+			encode(&e, RAM_OFFSET + addr, chip->ram + addr,
+				rw->key.ram + addr, CHIP8_PAGEBYTES);
+		}
+	}
+	return e.len;
+}
+
+/* Drop the oldest keyframe and the deltas that need it */
+static void evict(struct chip8_rewind *rw)
+{
+	do {
+		rw->used -= ENTRY(rw, 0)->size;
+		rw->first = (rw->first + 1) % rw->capacity;
+		rw->count--;
+	} while (rw->count > 0 && !ENTRY(rw, 0)->is_key);
+}
+
+/* Make room for size bytes at head, evicting what is in the way */
+static int reserve(struct chip8_rewind *rw, size_t size)
+{
+	struct entry *entries;
+	size_t i;
+
+	if (size > rw->budget) {
+		return -1;
+	}
+	if (rw->count == 0) {
+		rw->head = 0;
+	}
+	if (rw->head + size > rw->budget) {
+		while (rw->count > 0 && ENTRY(rw, 0)->offset >= rw->head) {
+			evict(rw);
+		}
+		rw->head = 0;
+	}
+	while (rw->count > 0 && ENTRY(rw, 0)->offset >= rw->head
+		&& ENTRY(rw, 0)->offset < rw->head + size) {
+		evict(rw);
+	}
+	if (rw->count < rw->capacity) {
+		return 0;
+	}
+	entries = malloc(2 * rw->capacity * sizeof(*entries));
+	if (entries == NULL) {
+		return -1;
+	}
+	for (i = 0; i < rw->count; i++) {
+		entries[i] = *ENTRY(rw, i);
+	}
+	free(rw->entries);
+	rw->entries = entries;
+	rw->capacity *= 2;
+	rw->first = 0;
+	return 0;
+}
+
+/*
+ * Keep up to budget bytes of encoded frames, with a keyframe every
+ * keyframe_interval frames. Returns NULL if memory runs out.
+ */
+struct chip8_rewind *chip8_rewind_new(size_t budget,
+	unsigned int keyframe_interval)
+{
+	struct chip8_rewind *rw = calloc(1, sizeof(*rw));
+
+	if (rw == NULL) {
+		return NULL;
+	}
+	rw->budget = budget;
+	rw->interval = keyframe_interval > 0 ? keyframe_interval
+		: CHIP8_REWIND_KEYFRAME;
+	rw->capacity = 1024;
+	rw->buf = malloc(budget);
+	rw->entries = malloc(rw->capacity * sizeof(*rw->entries));
+	rw->encoded = malloc(MAX_RECORD);
+	if (rw->buf == NULL || rw->entries == NULL || rw->encoded == NULL) {
+		chip8_rewind_free(rw);
+		return NULL;
+	}
+	return rw;
+}
+
+void chip8_rewind_free(struct chip8_rewind *rw)
+{
+	if (rw == NULL) {
+		return;
+	}
+	free(rw->buf);
+	free(rw->entries);
+	free(rw->encoded);
+	free(rw);
+}
+
+/*
+ * Store the machine's state as the newest frame; call once per frame.
+ * Returns -1 if a frame does not fit in the budget at all.
+ */
+int chip8_rewind_capture(struct chip8_rewind *rw, struct chip8 *chip)
+{
+	int is_key = rw->count == 0 || rw->since_key + 1 >= rw->interval;
+	struct entry *entry;
+	size_t size;
+
+	size = is_key ? encode_key(rw, chip) : encode_delta(rw, chip);
+	if (reserve(rw, size) < 0) {
+		return -1;
+	}
+	/* Making room took this delta's keyframe */
+	if (!is_key && rw->count == 0) {
+		is_key = 1;
+		size = encode_key(rw, chip);
+		if (reserve(rw, size) < 0) {
+			return -1;
+		}
+	}
+	memcpy(rw->buf + rw->head, rw->encoded, size);
+	entry = ENTRY(rw, rw->count);
+	entry->offset = rw->head;
+	entry->size = size;
+	entry->is_key = is_key;
+	rw->count++;
+	rw->head += size;
+	rw->used += size;
+	rw->since_key = is_key ? 0 : rw->since_key + 1;
+	return 0;
+}
+
+/*
+ * Put the machine back in the state it was in frames captures before the
+ * newest one, and forget every frame after that. Returns how many frames
+ * it went back, which is less than asked when the history runs out.
+ */
+unsigned long chip8_rewind_back(struct chip8_rewind *rw, struct chip8 *chip,
+	unsigned long frames)
+{
+	struct entry *entry;
+	uint32_t pages = 0;
+	size_t target;
+	size_t key;
+	size_t i;
+
+	if (rw->count == 0) {
+		return 0;
+	}
+	if (frames > rw->count - 1) {
+		frames = rw->count - 1;
+	}
+	target = rw->count - 1 - frames;
+	for (key = target; !ENTRY(rw, key)->is_key; key--) {
+	}
+	if (key != rw->count - 1 - rw->since_key) {
+		entry = ENTRY(rw, key);
+		memset(&rw->key, 0, sizeof(rw->key));
+		apply(&rw->key, rw->buf + entry->offset, entry->size);
+	}
+	rw->work = rw->key;
+	if (target != key) {
+		entry = ENTRY(rw, target);
+		pages = apply(&rw->work, rw->buf + entry->offset, entry->size);
+	}
+	/*
+	 * The frame differs from the keyframe in these pages, which restore
+	 * has to copy even if the machine has not written them since
+	 */
+	chip->dirty_pages |= pages;
+	chip8_restore(chip, &rw->work);
+	chip->dirty_pages = pages;
+
+	for (i = target + 1; i < rw->count; i++) {
+		rw->used -= ENTRY(rw, i)->size;
+	}
+	entry = ENTRY(rw, target);
+	rw->head = entry->offset + entry->size;
+	rw->count = target + 1;
+	rw->since_key = target - key;
+	return frames;
+}
+
+/* How many frames can be gone back to, counting the newest */
+unsigned long chip8_rewind_frames(struct chip8_rewind *rw)
+{
+	return rw->count;
+}
+
+/* Bytes of the budget the stored frames take */
+size_t chip8_rewind_bytes(struct chip8_rewind *rw)
+{
+	return rw->used;
+}
@@ -0,0 +1,33 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stddef.h>
+#include "chip8.h"
+
+/* Frames between full states; the ones in between are stored as deltas */
+#define CHIP8_REWIND_KEYFRAME 60
+/* Ten minutes at 60 frames a second fit in this for typical ROMs */
+#define CHIP8_REWIND_BUDGET (4 * 1024 * 1024)
+
+struct chip8_rewind;
+
+struct chip8_rewind *chip8_rewind_new(size_t budget,
+	unsigned int keyframe_interval);
+void chip8_rewind_free(struct chip8_rewind *rw);
+int chip8_rewind_capture(struct chip8_rewind *rw, struct chip8 *chip);
+unsigned long chip8_rewind_back(struct chip8_rewind *rw, struct chip8 *chip,
+	unsigned long frames);
+unsigned long chip8_rewind_frames(struct chip8_rewind *rw);
+size_t chip8_rewind_bytes(struct chip8_rewind *rw);
+
+#endif /* REWIND_H */
@@ -0,0 +1,257 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+/*
+ * Save states on disk. A file is a short header and a struct
+ * chip8_snapshot, so loading one maps the file and restores from the
+ * mapping with nothing to parse. A file is written next to its final name
+ * and renamed over it, so a reader only ever sees a whole state.
+ *
+ * The saver writes on a thread of its own. Saving copies the machine into
+ * whichever of two buffers the thread is not writing, which takes a few
+ * microseconds, and leaves the disk to the thread. A save that comes while
+ * an earlier one is still waiting replaces it.
+ */
+
+#include "savestate.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct chip8_saver {
+	struct chip8_savestate states[2];
+	char paths[2][PATH_MAX];
+	int pending; /* The buffer waiting to be written, or -1 */
+	int writing; /* The buffer the thread is writing, or -1 */
+	int quit;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_t thread;
+};
+
+/* Fill in the header and copy the machine's state into state */
+void chip8_savestate_fill(struct chip8_savestate *state, struct chip8 *chip)
+{
+	memcpy(state->magic, CHIP8_SAVESTATE_MAGIC, sizeof(state->magic));
+	state->version = CHIP8_SAVESTATE_VERSION;
+	state->byte_order = CHIP8_SAVESTATE_BYTE_ORDER;
+	state->header_size = offsetof(struct chip8_savestate, snapshot);
+	state->snapshot_size = sizeof(state->snapshot);
+	chip8_capture(chip, &state->snapshot);
+}
+
+/* Write state to path, replacing any file there in one step */
+int chip8_savestate_write(const struct chip8_savestate *state,
+	const char *path)
+{
+	char tmp[PATH_MAX];
+	const char *p = (const char *) state;
+	size_t left = sizeof(*state);
+	ssize_t n;
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+		fprintf(stderr, "%s: Path is too long\n", path);
+		return -1;
+	}
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(tmp);
+		return -1;
+	}
+	while (left > 0) {
+		n = write(fd, p, left);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			perror(tmp);
+			close(fd);
+			unlink(tmp);
+			return -1;
+		}
+		p += n;
+		left -= n;
+	}
+	if (fsync(fd) < 0 || close(fd) < 0 || rename(tmp, path) < 0) {
+		perror(path);
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Map the save state in path read-only and check that this build can
+ * restore from it. Returns NULL on error.
+ */
+const struct chip8_savestate *chip8_savestate_map(const char *path)
+{
+	const struct chip8_savestate *state;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0) {
+		perror(path);
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size != sizeof(*state)) {
+		fprintf(stderr, "%s: Not a save state for this build\n", path);
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, sizeof(*state), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(path);
+		return NULL;
+	}
+	state = map;
+	if (memcmp(state->magic, CHIP8_SAVESTATE_MAGIC, sizeof(state->magic))
+		|| state->version != CHIP8_SAVESTATE_VERSION
+		|| state->byte_order != CHIP8_SAVESTATE_BYTE_ORDER
+		|| state->header_size
+			!= offsetof(struct chip8_savestate, snapshot)
+		|| state->snapshot_size != sizeof(state->snapshot)) {
+		fprintf(stderr, "%s: Not a save state for this build\n", path);
+		chip8_savestate_unmap(state);
+		return NULL;
+	}
+	/* Restoring indexes the stack, RAM and the fault names with these */
+	if (state->snapshot.sp >= CHIP8_STACKSIZE
+		|| state->snapshot.pc >= CHIP8_RAMBYTES
+		|| state->snapshot.reg_i >= CHIP8_RAMBYTES
+		|| (unsigned int) state->snapshot.fault >= CHIP8_FAULT_COUNT) {
+		fprintf(stderr, "%s: Corrupt save state\n", path);
+		chip8_savestate_unmap(state);
+		return NULL;
+	}
+	return state;
+}
+
+void chip8_savestate_unmap(const struct chip8_savestate *state)
+{
+	munmap((void *) state, sizeof(*state));
+}
+
+/* Put the machine in the state saved in path */
+int chip8_savestate_load(struct chip8 *chip, const char *path)
+{
+	const struct chip8_savestate *state = chip8_savestate_map(path);
+
+	if (state == NULL) {
+		return -1;
+	}
+	chip8_restore(chip, &state->snapshot);
+	chip8_savestate_unmap(state);
+	return 0;
+}
+
+static void *saver_main(void *arg)
+{
+	struct chip8_saver *saver = arg;
+
+	pthread_mutex_lock(&saver->lock);
+	while (1) {
+		while (saver->pending < 0 && !saver->quit) {
+			pthread_cond_wait(&saver->work, &saver->lock);
+		}
+		/* Whatever was saved before quitting is still written */
+		if (saver->pending < 0) {
+			break;
+		}
+		saver->writing = saver->pending;
+		saver->pending = -1;
+		pthread_mutex_unlock(&saver->lock);
+		chip8_savestate_write(&saver->states[saver->writing],
+			saver->paths[saver->writing]);
+		pthread_mutex_lock(&saver->lock);
+		saver->writing = -1;
+	}
+	pthread_mutex_unlock(&saver->lock);
+	return NULL;
+}
+
+/* Start the writer thread. Returns NULL on error. */
+struct chip8_saver *chip8_saver_new(void)
+{
+	struct chip8_saver *saver = calloc(1, sizeof(*saver));
+
+	if (saver == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	saver->pending = -1;
+	saver->writing = -1;
+	pthread_mutex_init(&saver->lock, NULL);
+	pthread_cond_init(&saver->work, NULL);
+	if (pthread_create(&saver->thread, NULL, saver_main, saver) != 0) {
+		fprintf(stderr, "Failed to start the save-state writer\n");
+		pthread_mutex_destroy(&saver->lock);
+		pthread_cond_destroy(&saver->work);
+		free(saver);
+		return NULL;
+	}
+	return saver;
+}
+
+/* Finish writing what has been saved, then stop the writer thread */
+void chip8_saver_free(struct chip8_saver *saver)
+{
+	if (saver == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&saver->lock);
+	saver->quit = 1;
+	pthread_cond_signal(&saver->work);
+	pthread_mutex_unlock(&saver->lock);
+	pthread_join(saver->thread, NULL);
+	pthread_mutex_destroy(&saver->lock);
+	pthread_cond_destroy(&saver->work);
+	free(saver);
+}
+
+/*
+ * Save the machine's state to path in the background. It is copied before
+ * this returns, so the machine can run on at once.
+ */
+int chip8_saver_save(struct chip8_saver *saver, struct chip8 *chip,
+	const char *path)
+{
+	int slot;
+
+	if (strlen(path) + sizeof(".tmp") > PATH_MAX) {
+		fprintf(stderr, "%s: Path is too long\n", path);
+		return -1;
+	}
+	pthread_mutex_lock(&saver->lock);
+	slot = saver->writing == 0 ? 1 : 0;
+	chip8_savestate_fill(&saver->states[slot], chip);
+	strcpy(saver->paths[slot], path);
+	saver->pending = slot;
+	pthread_cond_signal(&saver->work);
+	pthread_mutex_unlock(&saver->lock);
+	return 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include <stdint.h>
+#include "chip8.h"
+#include "snapshot.h"
+
+#define CHIP8_SAVESTATE_MAGIC "CHIP8SAV"
+#define CHIP8_SAVESTATE_VERSION 3
+/* Written as is; reads back as something else on the other byte order */
+#define CHIP8_SAVESTATE_BYTE_ORDER 0x01020304
+
+/*
+ * A save-state file is this structure exactly as it is in memory, so it is
+ * mapped and restored from in place. The header rejects files written by
+ * another version or by a host that lays the snapshot out differently.
+ */
+struct chip8_savestate {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t header_size;
+	uint32_t snapshot_size;
+	struct chip8_snapshot snapshot;
+};
+
+struct chip8_saver;
+
+void chip8_savestate_fill(struct chip8_savestate *state, struct chip8 *chip);
+int chip8_savestate_write(const struct chip8_savestate *state,
+	const char *path);
+const struct chip8_savestate *chip8_savestate_map(const char *path);
+void chip8_savestate_unmap(const struct chip8_savestate *state);
+int chip8_savestate_load(struct chip8 *chip, const char *path);
+
+struct chip8_saver *chip8_saver_new(void);
+void chip8_saver_free(struct chip8_saver *saver);
+int chip8_saver_save(struct chip8_saver *saver, struct chip8 *chip,
+	const char *path);
+
+#endif /* SAVESTATE_H */
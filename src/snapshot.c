@@ -0,0 +1,106 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#include "snapshot.h"
+#include <string.h>
+#include <pthread.h>
+
+#define ALL_PAGES ((uint32_t) ((1ULL << CHIP8_PAGES) - 1))
+
+static pthread_mutex_t serial_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long last_serial;
+
+/* Every snapshot taken gets a number no other one has, never 0 */
+static unsigned long next_serial(void)
+{
+	unsigned long serial;
+	pthread_mutex_lock(&serial_lock);
+	serial = ++last_serial;
+	pthread_mutex_unlock(&serial_lock);
+	return serial;
+}
+
+/*
+ * Copy the machine state into snap, leaving the machine's page tracking
+ * alone. snap gets serial 0, which chip8_restore copies all of RAM for.
+ */
+void chip8_capture(struct chip8 *chip, struct chip8_snapshot *snap)
+{
+	snap->serial = 0;
+	memcpy(snap->reg_v, chip->reg_v, sizeof(snap->reg_v));
+	snap->reg_i = chip->reg_i;
+	snap->pc = chip->pc;
+	snap->sp = chip->sp;
+	snap->ticks = chip->ticks;
+	snap->dt_expiry = chip->dt_expiry;
+	snap->st_expiry = chip->st_expiry;
+	memcpy(snap->stack, chip->stack, sizeof(snap->stack));
+	snap->rand_state = chip->rand_state;
+	snap->is_halted = chip->is_halted;
+	snap->fault = chip->fault;
+	snap->key_wait = chip->key_wait;
+	snap->cycles = chip->cycles;
+	memcpy(snap->display, chip->display, sizeof(snap->display));
+	memcpy(snap->ram, chip->ram, sizeof(snap->ram));
+}
+
+/*
+ * Save the machine state into snap. From here on the machine tracks which
+ * RAM pages it writes, so restoring snap only copies those back.
+ */
+void chip8_snapshot(struct chip8 *chip, struct chip8_snapshot *snap)
+{
+	chip8_capture(chip, snap);
+	snap->serial = next_serial();
+	chip->snapshot_serial = snap->serial;
+	chip->dirty_pages = 0;
+}
+
+/*
+ * Put the machine back in the state saved in snap. If snap is the snapshot
+ * the machine last took or was restored from, only the RAM pages written
+ * since are copied; otherwise, or if snap came from chip8_capture, all of
+ * RAM is.
+ */
+void chip8_restore(struct chip8 *chip, const struct chip8_snapshot *snap)
+{
+	uint32_t pages = chip->dirty_pages;
+	unsigned short addr;
+	int page;
+
+	if (snap->serial == 0 || chip->snapshot_serial != snap->serial) {
+		pages = ALL_PAGES;
+	}
+	memcpy(chip->reg_v, snap->reg_v, sizeof(chip->reg_v));
+	chip->reg_i = snap->reg_i;
+	chip->pc = snap->pc;
+	chip->sp = snap->sp;
+	chip->ticks = snap->ticks;
+	chip->dt_expiry = snap->dt_expiry;
+	chip->st_expiry = snap->st_expiry;
+	memcpy(chip->stack, snap->stack, sizeof(chip->stack));
+	chip->rand_state = snap->rand_state;
+	chip->is_halted = snap->is_halted;
+	chip->fault = snap->fault;
+	chip->key_wait = snap->key_wait;
+	chip->cycles = snap->cycles;
+	memcpy(chip->display, snap->display, sizeof(chip->display));
+	chip->display_dirty = 1;
+	for (page = 0; page < CHIP8_PAGES; page++) {
+		if (pages >> page & 0x1) {
+			addr = page * CHIP8_PAGEBYTES;
+			memcpy(chip->ram + addr, snap->ram + addr,
+				CHIP8_PAGEBYTES);
+			chip8_icache_invalidate(chip, addr, CHIP8_PAGEBYTES);
+		}
+	}
+	chip->snapshot_serial = snap->serial;
+	chip->dirty_pages = 0;
+}
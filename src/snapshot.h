@@ -0,0 +1,43 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "chip8.h"
+
+/*
+ * Everything that makes up the state of a running machine, as one flat
+ * block; no pointers, so it can be copied around freely
+ */
+struct chip8_snapshot {
+	unsigned long serial;
+	byte reg_v[CHIP8_REGCOUNT];
+	unsigned int reg_i;
+	unsigned short pc;
+	unsigned short sp;
+	unsigned long ticks;
+	unsigned long dt_expiry;
+	unsigned long st_expiry;
+	unsigned short stack[CHIP8_STACKSIZE];
+	uint32_t rand_state;
+	int is_halted;
+	enum chip8_fault fault;
+	int key_wait;
+	unsigned long cycles;
+	uint64_t display[CHIP8_DISPLAYH];
+	byte ram[CHIP8_RAMBYTES];
+};
+
+void chip8_capture(struct chip8 *chip, struct chip8_snapshot *snap);
+void chip8_snapshot(struct chip8 *chip, struct chip8_snapshot *snap);
+void chip8_restore(struct chip8 *chip, const struct chip8_snapshot *snap);
+
+#endif /* SNAPSHOT_H */
@@ -0,0 +1,208 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#include "threaded.h"
+#include "dispatch.h"
+#include "idle.h"
+
+#ifdef __GNUC__
+
+/*
+ * Direct-threaded interpreter: every handler ends in its own indirect jump to
+ * the next handler, with operand fields taken from the decoded instruction
+ * cache. The simple register and branch instructions are implemented inline;
+ * anything touching the display, keyboard, stack or memory goes through the
+ * regular handler so both engines share the same semantics.
+ */
+void chip8_exec_threaded(struct chip8 *chip)
+{
+	static void *labels[CHIP8_OP_COUNT] = {
+		[CHIP8_OP_NOP] = &&op_nop,
+		[CHIP8_OP_CLS] = &&op_handler,
+		[CHIP8_OP_RET] = &&op_handler,
+		[CHIP8_OP_EXIT] = &&op_exit,
+		[CHIP8_OP_JP] = &&op_jp,
+		[CHIP8_OP_CALL] = &&op_handler,
+		[CHIP8_OP_SE_IMM] = &&op_se_imm,
+		[CHIP8_OP_SNE_IMM] = &&op_sne_imm,
+		[CHIP8_OP_SE] = &&op_se,
+		[CHIP8_OP_LD_IMM] = &&op_ld_imm,
+		[CHIP8_OP_ADD_IMM] = &&op_add_imm,
+		[CHIP8_OP_LD] = &&op_ld,
+		[CHIP8_OP_OR] = &&op_or,
+		[CHIP8_OP_AND] = &&op_and,
+		[CHIP8_OP_ADD] = &&op_add,
+		[CHIP8_OP_SUB] = &&op_sub,
+		[CHIP8_OP_SHR] = &&op_shr,
+		[CHIP8_OP_SUBN] = &&op_subn,
+		[CHIP8_OP_SHL] = &&op_shl,
+		[CHIP8_OP_SNE] = &&op_sne,
+		[CHIP8_OP_LD_I] = &&op_ld_i,
+		[CHIP8_OP_JP_V0] = &&op_handler,
+		[CHIP8_OP_RND] = &&op_handler,
+		[CHIP8_OP_DRW] = &&op_handler,
+		[CHIP8_OP_SKP] = &&op_handler,
+		[CHIP8_OP_SKNP] = &&op_handler,
+		[CHIP8_OP_LD_VX_DT] = &&op_handler,
+		[CHIP8_OP_LD_VX_K] = &&op_ld_vx_k,
+		[CHIP8_OP_LD_DT_VX] = &&op_handler,
+		[CHIP8_OP_LD_ST_VX] = &&op_handler,
+		[CHIP8_OP_LD_F_VX] = &&op_handler,
+		[CHIP8_OP_LD_B_VX] = &&op_handler,
+		[CHIP8_OP_LD_I_VX] = &&op_handler,
+		[CHIP8_OP_LD_VX_I] = &&op_handler,
+		[CHIP8_OP_UNKNOWN] = &&op_handler,
+		[CHIP8_OP_INVALID] = &&op_handler
+	};
+	byte *v = chip->reg_v;
+	struct chip8_decoded *d;
+	unsigned short ins;
+	unsigned short nnn;
+	byte x, y, kk;
+
+#define DISPATCH() do { \
+	if (chip->pc + 2 >= CHIP8_RAMBYTES || chip->is_halted) { \
+		goto done; \
+	} \
+	d = chip8_fetch(chip); \
+	ins = d->ins; \
+	x = d->x; \
+	y = d->y; \
+	kk = d->kk; \
+	nnn = d->nnn; \
+	goto *labels[d->op]; \
+} while (0)
+
+#define NEXT() do { \
+	chip->cycles++; \
+	if (chip->frame_pending) { \
+		chip8_present(chip); \
+	} \
+	chip->check_kill(chip); \
+	DISPATCH(); \
+} while (0)
+
+	DISPATCH();
+
+op_nop:
+	NEXT();
+op_handler:
+	if (d->handler(chip, ins) != 0) {
+		goto done;
+	}
+	NEXT();
+op_exit:
+	goto done;
+op_ld_vx_k:
+	d->handler(chip, ins);
+	/* Found no key, so it runs again: a wait loop of its own */
+	if (chip->key_wait) {
+		goto idle;
+	}
+	NEXT();
+op_jp:
+	chip->pc = nnn;
+	/* Wait loops end in a JP back to their head, so look there only */
+	if (chip8_decoded_at(chip, nnn)->idle != CHIP8_IDLE_NONE) {
+		goto idle;
+	}
+	NEXT();
+op_se_imm:
+	if (v[x] == kk) {
+		chip->pc += 2;
+	}
+	NEXT();
+op_sne_imm:
+	if (v[x] != kk) {
+		chip->pc += 2;
+	}
+	NEXT();
+op_se:
+	if (v[x] == v[y]) {
+		chip->pc += 2;
+	}
+	NEXT();
+op_sne:
+	if (v[x] != v[y]) {
+		chip->pc += 2;
+	}
+	NEXT();
+op_ld_imm:
+	v[x] = kk;
+	NEXT();
+op_add_imm:
+	v[x] += kk;
+	NEXT();
+op_ld:
+	v[x] = v[y];
+	NEXT();
+op_or:
+	v[x] |= v[y];
+	NEXT();
+op_and:
+	v[x] &= v[y];
+	NEXT();
+	/* VF is written before the result, as in instructions.c */
+op_add:
+	nnn = v[x] + v[y];
+	v[0xF] = nnn > 0xFF;
+	v[x] = nnn;
+	NEXT();
+op_sub:
+	v[0xF] = v[x] > v[y];
+	v[x] = v[x] - v[y];
+	NEXT();
+op_shr:
+	v[0xF] = v[x] & 0x1;
+	v[x] = v[x] >> 1;
+	NEXT();
+op_subn:
+	v[0xF] = v[y] > v[x];
+	v[x] = v[y] - v[x];
+	NEXT();
+op_shl:
+	v[0xF] = v[x] & 0x1;
+	v[x] = v[x] << 1;
+	NEXT();
+op_ld_i:
+	chip->reg_i = nnn;
+	NEXT();
+
+idle:
+	chip->cycles++;
+	if (chip->frame_pending) {
+		chip8_present(chip);
+	}
+	chip->check_kill(chip);
+	d = chip8_decoded_at(chip, chip->pc);
+	if (d->idle != CHIP8_IDLE_NONE && chip8_idle(chip, d)) {
+		if (chip->frame_pending) {
+			chip8_present(chip);
+		}
+		chip->check_kill(chip);
+	}
+	DISPATCH();
+
+#undef NEXT
+#undef DISPATCH
+
+done:
+	chip8_halt(chip);
+}
+
+#else /* __GNUC__ */
+
+/* Without labels-as-values there is nothing to thread; use the table loop */
+void chip8_exec_threaded(struct chip8 *chip)
+{
+	chip8_interpret(chip);
+}
+
+#endif /* __GNUC__ */
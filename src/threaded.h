@@ -0,0 +1,18 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#ifndef THREADED_H
+#define THREADED_H
+
+#include "chip8.h"
+
+void chip8_exec_threaded(struct chip8 *chip);
+
+#endif /* THREADED_H */
@@ -0,0 +1,374 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+/*
+ * A batch of environments for reinforcement learning, all running one ROM.
+ * Every step advances each environment by one frame under the keys in its
+ * action and writes the observations, rewards and done flags straight into
+ * the caller's arrays, indexed by environment. A finished episode restarts
+ * within the same step by restoring a snapshot of the freshly loaded
+ * machine, which only copies back the RAM pages the episode wrote. The
+ * environments are split into one contiguous slice per thread of a pool
+ * that lives as long as the batch, so a step allocates nothing.
+ */
+
+#include "vecenv.h"
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+struct env {
+	struct chip8 *chip;
+	struct chip8_keyboard keyboard;
+	unsigned short keys;
+	unsigned long frame;
+	unsigned long episodes;
+	byte reward_bytes[CHIP8_VECENV_MAXREWARDS];
+};
+
+struct vecenv_worker {
+	struct chip8_vecenv *venv;
+	int id;
+	pthread_t thread;
+};
+
+struct chip8_vecenv {
+	struct chip8_vecenv_config config;
+	struct env *envs;
+	struct chip8 *initial;
+	struct chip8_snapshot start;
+	struct chip8_renderer renderer;
+	struct vecenv_worker *workers;
+	int nthreads;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t idle;
+	unsigned long generation;
+	int busy;
+	int quit;
+
+	/* Arguments of the call being worked on */
+	int resetting;
+	const unsigned short *actions;
+	byte *obs;
+	float *rewards;
+	byte *dones;
+};
+
+static void null_render(struct chip8 *chip)
+{
+	(void) chip;
+}
+
+static void null_check(struct chip8 *chip)
+{
+	(void) chip;
+}
+
+static int env_is_key_down(struct chip8 *chip, byte keyval)
+{
+	struct env *env = chip->keyboard->data;
+	return keyval <= 0xF && (env->keys >> keyval & 0x1);
+}
+
+/* Take the lowest key in the action, or wait for the next one */
+static byte env_waitkey(struct chip8 *chip)
+{
+	struct env *env = chip->keyboard->data;
+	return chip8_lowest_key(env->keys);
+}
+
+static void write_obs(struct chip8 *chip, byte *obs)
+{
+	uint64_t row;
+	int x, y;
+	for (y = 0; y < CHIP8_DISPLAYH; y++) {
+		row = chip->display[y];
+		for (x = 0; x < CHIP8_DISPLAYW; x++) {
+			*obs++ = row >> (CHIP8_DISPLAYW - 1 - x) & 0x1;
+		}
+	}
+}
+
+/* Start a new episode, with a seed no other episode uses */
+static void env_reset(struct chip8_vecenv *venv, struct env *env, size_t i)
+{
+	struct chip8_vecenv_config *config = &venv->config;
+	size_t r;
+
+	chip8_restore(env->chip, &venv->start);
+	chip8_seed(env->chip, config->seed + i
+		+ env->episodes * config->num_envs);
+	env->episodes++;
+	env->frame = 0;
+	env->keys = 0;
+	for (r = 0; r < config->num_rewards; r++) {
+		env->reward_bytes[r] =
+			env->chip->ram[config->rewards[r].addr];
+	}
+}
+
+static float env_reward(struct chip8_vecenv *venv, struct env *env)
+{
+	struct chip8_vecenv_config *config = &venv->config;
+	float reward = 0;
+	byte now;
+	size_t r;
+
+	for (r = 0; r < config->num_rewards; r++) {
+		now = env->chip->ram[config->rewards[r].addr];
+		reward += (float) config->rewards[r].weight
+			* ((int) now - (int) env->reward_bytes[r]);
+		env->reward_bytes[r] = now;
+	}
+	return reward;
+}
+
+/* Run one frame; returns 1 if the episode is over */
+static int env_frame(struct chip8_vecenv *venv, struct env *env)
+{
+	struct chip8 *chip = env->chip;
+	unsigned long end = (env->frame + 1) * venv->config.ipf;
+
+	chip->idle_until = end;
+	while (chip->cycles < end) {
+		if (chip->is_halted || chip->pc + 2 >= CHIP8_RAMBYTES
+			|| chip8_exec_instruction(chip) < 0) {
+			return 1;
+		}
+	}
+	chip8_tick(chip, 1);
+	env->frame++;
+	return venv->config.max_frames > 0
+		&& env->frame >= venv->config.max_frames;
+}
+
+static void run_slice(struct chip8_vecenv *venv, int id)
+{
+	size_t n = venv->config.num_envs;
+	size_t first = n * id / venv->nthreads;
+	size_t last = n * (id + 1) / venv->nthreads;
+	struct env *env;
+	int done;
+	size_t i;
+
+	for (i = first; i < last; i++) {
+		env = &venv->envs[i];
+		if (venv->resetting) {
+			env_reset(venv, env, i);
+		} else {
+			env->keys = venv->actions[i];
+			done = env_frame(venv, env);
+			venv->rewards[i] = env_reward(venv, env);
+			venv->dones[i] = done;
+			if (done) {
+				env_reset(venv, env, i);
+			}
+		}
+		write_obs(env->chip, venv->obs + i * CHIP8_OBS_BYTES);
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	struct vecenv_worker *worker = arg;
+	struct chip8_vecenv *venv = worker->venv;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&venv->lock);
+	while (1) {
+		while (venv->generation == seen && !venv->quit) {
+			pthread_cond_wait(&venv->work, &venv->lock);
+		}
+		if (venv->quit) {
+			break;
+		}
+		seen = venv->generation;
+		pthread_mutex_unlock(&venv->lock);
+		run_slice(venv, worker->id);
+		pthread_mutex_lock(&venv->lock);
+		if (--venv->busy == 0) {
+			pthread_cond_signal(&venv->idle);
+		}
+	}
+	pthread_mutex_unlock(&venv->lock);
+	return NULL;
+}
+
+/* Have every thread run its slice of the call set up in venv */
+static void run_all(struct chip8_vecenv *venv)
+{
+	if (venv->nthreads == 1) {
+		run_slice(venv, 0);
+		return;
+	}
+	pthread_mutex_lock(&venv->lock);
+	venv->busy = venv->nthreads;
+	venv->generation++;
+	pthread_cond_broadcast(&venv->work);
+	while (venv->busy > 0) {
+		pthread_cond_wait(&venv->idle, &venv->lock);
+	}
+	pthread_mutex_unlock(&venv->lock);
+}
+
+/*
+ * Load the ROM once and start the thread pool. The environments are not
+ * ready until chip8_vecenv_reset has been called. Returns NULL on error.
+ */
+struct chip8_vecenv *chip8_vecenv_new(
+	const struct chip8_vecenv_config *config)
+{
+	struct chip8_vecenv *venv;
+	size_t i;
+	int t;
+
+	for (i = 0; i < config->num_rewards; i++) {
+		if (i >= CHIP8_VECENV_MAXREWARDS
+			|| config->rewards[i].addr >= CHIP8_RAMBYTES) {
+			fprintf(stderr, "Bad reward address\n");
+			return NULL;
+		}
+	}
+	venv = calloc(1, sizeof(*venv));
+	if (venv == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	venv->config = *config;
+	if (venv->config.ipf == 0) {
+		venv->config.ipf = CHIP8_VECENV_IPF;
+	}
+	venv->nthreads = config->threads > 0 ? config->threads
+		: sysconf(_SC_NPROCESSORS_ONLN);
+	if ((size_t) venv->nthreads > config->num_envs) {
+		venv->nthreads = config->num_envs;
+	}
+	if (venv->nthreads < 1) {
+		venv->nthreads = 1;
+	}
+
+	venv->renderer.data = NULL;
+	venv->renderer.render_display = null_render;
+	venv->initial = malloc(sizeof(*venv->initial));
+	venv->envs = calloc(config->num_envs, sizeof(*venv->envs));
+	if (venv->initial == NULL || venv->envs == NULL) {
+		perror("malloc");
+		chip8_vecenv_free(venv);
+		return NULL;
+	}
+	chip8_init(venv->initial, NULL, &venv->renderer, null_check);
+	if (chip8_load(venv->initial, (char *) config->rom) < 0) {
+		chip8_vecenv_free(venv);
+		return NULL;
+	}
+	venv->initial->pc = CHIP8_PROGSTART;
+	/* A fused sequence could run past the end of a frame's instructions */
+	venv->initial->fusion_enabled = 0;
+	chip8_snapshot(venv->initial, &venv->start);
+	for (i = 0; i < config->num_envs; i++) {
+		venv->envs[i].chip = malloc(sizeof(*venv->envs[i].chip));
+		if (venv->envs[i].chip == NULL) {
+			perror("malloc");
+			chip8_vecenv_free(venv);
+			return NULL;
+		}
+		/* Copies the decoded instructions too, once and for all */
+		memcpy(venv->envs[i].chip, venv->initial,
+			sizeof(*venv->envs[i].chip));
+		venv->envs[i].chip->keyboard = &venv->envs[i].keyboard;
+		venv->envs[i].keyboard.data = &venv->envs[i];
+		venv->envs[i].keyboard.waitkey = env_waitkey;
+		venv->envs[i].keyboard.is_key_down = env_is_key_down;
+	}
+
+	if (venv->nthreads == 1) {
+		return venv;
+	}
+	venv->workers = calloc(venv->nthreads, sizeof(*venv->workers));
+	if (venv->workers == NULL) {
+		perror("calloc");
+		chip8_vecenv_free(venv);
+		return NULL;
+	}
+	pthread_mutex_init(&venv->lock, NULL);
+	pthread_cond_init(&venv->work, NULL);
+	pthread_cond_init(&venv->idle, NULL);
+	for (t = 0; t < venv->nthreads; t++) {
+		venv->workers[t].venv = venv;
+		venv->workers[t].id = t;
+		if (pthread_create(&venv->workers[t].thread, NULL,
+			worker_main, &venv->workers[t]) != 0) {
+			fprintf(stderr, "Failed to start a worker thread\n");
+			/* Stop the ones that did start */
+			venv->nthreads = t;
+			chip8_vecenv_free(venv);
+			return NULL;
+		}
+	}
+	return venv;
+}
+
+void chip8_vecenv_free(struct chip8_vecenv *venv)
+{
+	size_t i;
+	int t;
+
+	if (venv == NULL) {
+		return;
+	}
+	if (venv->workers != NULL) {
+		pthread_mutex_lock(&venv->lock);
+		venv->quit = 1;
+		pthread_cond_broadcast(&venv->work);
+		pthread_mutex_unlock(&venv->lock);
+		for (t = 0; t < venv->nthreads; t++) {
+			pthread_join(venv->workers[t].thread, NULL);
+		}
+		pthread_mutex_destroy(&venv->lock);
+		pthread_cond_destroy(&venv->work);
+		pthread_cond_destroy(&venv->idle);
+	}
+	free(venv->workers);
+	for (i = 0; venv->envs != NULL && i < venv->config.num_envs; i++) {
+		free(venv->envs[i].chip);
+	}
+	free(venv->envs);
+	free(venv->initial);
+	free(venv);
+}
+
+/* Start a new episode everywhere; obs holds num_envs observations */
+void chip8_vecenv_reset(struct chip8_vecenv *venv, byte *obs)
+{
+	venv->resetting = 1;
+	venv->obs = obs;
+	run_all(venv);
+}
+
+/*
+ * Advance every environment one frame with actions[i] as the mask of keys
+ * held down in environment i. Where dones[i] is set, the episode ended in
+ * this frame and obs already shows the first frame of the next one.
+ */
+void chip8_vecenv_step(struct chip8_vecenv *venv,
+	const unsigned short *actions, byte *obs, float *rewards,
+	byte *dones)
+{
+	venv->resetting = 0;
+	venv->actions = actions;
+	venv->obs = obs;
+	venv->rewards = rewards;
+	venv->dones = dones;
+	run_all(venv);
+}
@@ -0,0 +1,49 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2018 David Jackson
+ */
+
+#ifndef VECENV_H
+#define VECENV_H
+
+#include <stddef.h>
+#include "chip8.h"
+
+#define CHIP8_VECENV_IPF 10
+#define CHIP8_VECENV_MAXREWARDS 8
+/* One byte per pixel, 0 or 1, row-major */
+#define CHIP8_OBS_BYTES (CHIP8_DISPLAYW * CHIP8_DISPLAYH)
+
+/* A frame's reward includes weight times the change in the byte at addr */
+struct chip8_reward_byte {
+	unsigned short addr;
+	int weight;
+};
+
+struct chip8_vecenv_config {
+	const char *rom;
+	size_t num_envs;
+	int threads; /* 0 for one per online CPU */
+	unsigned int ipf; /* Instructions per frame, 0 for the default */
+	unsigned long max_frames; /* Frames per episode, 0 for no limit */
+	uint32_t seed;
+	size_t num_rewards;
+	struct chip8_reward_byte rewards[CHIP8_VECENV_MAXREWARDS];
+};
+
+struct chip8_vecenv;
+
+struct chip8_vecenv *chip8_vecenv_new(
+	const struct chip8_vecenv_config *config);
+void chip8_vecenv_free(struct chip8_vecenv *venv);
+void chip8_vecenv_reset(struct chip8_vecenv *venv, byte *obs);
+void chip8_vecenv_step(struct chip8_vecenv *venv,
+	const unsigned short *actions, byte *obs, float *rewards,
+	byte *dones);
+
+#endif /* VECENV_H */